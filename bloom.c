@@ -0,0 +1,141 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "tools.h"
+#include "msg.h"
+#include "bloom.h"
+
+#define BLOOM_BITS_PER_ID 10
+#define BLOOM_HASHES      7
+#define BLOOM_MIN_BITS    1024
+
+static uint64_t bloom_hash(const char* id);
+
+Bloom* bloom_init(size_t capacity)
+{
+	Bloom* bf = xmalloc(sizeof(*bf));
+	size_t nbits = BLOOM_MIN_BITS;
+
+	while (nbits < capacity*BLOOM_BITS_PER_ID && nbits < (size_t)1 << 31)
+		nbits *= 2;
+
+	bf->nbits    = nbits;
+	bf->nhashes  = BLOOM_HASHES;
+	bf->n        = 0;
+	bf->capacity = capacity;
+	bf->bits     = xcalloc(nbits/8, 1);
+
+	return bf;
+}
+
+void bloom_free(Bloom* bf)
+{
+	if (bf) {
+		free(bf->bits);
+		free(bf);
+	}
+}
+
+/* FNV-1a over the lowercased id. Its halves seed the probe sequence */
+static uint64_t bloom_hash(const char* id)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (; *id; ++id) {
+		hash ^= (unsigned char)tolower(*id);
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+void bloom_add(Bloom* bf, const char* id)
+{
+	uint64_t hash = bloom_hash(id);
+	uint32_t h1 = hash;
+	uint32_t h2 = (hash >> 32) | 1;
+	uint32_t bit;
+	uint32_t i;
+
+	for (i = 0; i < bf->nhashes; ++i) {
+		bit = (h1 +i*h2) & (bf->nbits -1);
+		bf->bits[bit/8] |= 1 << bit%8;
+	}
+
+	bf->n++;
+}
+
+bool bloom_test(const Bloom* bf, const char* id)
+{
+	uint64_t hash = bloom_hash(id);
+	uint32_t h1 = hash;
+	uint32_t h2 = (hash >> 32) | 1;
+	uint32_t bit;
+	uint32_t i;
+
+	for (i = 0; i < bf->nhashes; ++i) {
+		bit = (h1 +i*h2) & (bf->nbits -1);
+		if (!(bf->bits[bit/8] & 1 << bit%8))
+			return false;
+	}
+
+	return true;
+}
+
+/* Send the filter as a single frame.
+ * Return value:
+ * Same as write_msg()
+ * */
+int bloom_send(Bloom* bf, int fd)
+{
+	Bloom_header header;
+	size_t size = sizeof(header) +bf->nbits/8;
+	char* buf;
+	int ret;
+
+	memcpy(header.magic, BLOOM_MAGIC, sizeof(header.magic));
+	header.nbits   = bf->nbits;
+	header.nhashes = bf->nhashes;
+
+	buf = xmalloc(size);
+	memcpy(buf, &header, sizeof(header));
+	memcpy(buf +sizeof(header), bf->bits, bf->nbits/8);
+
+	ret = write_msg_buf(fd, buf, size);
+
+	free(buf);
+
+	return ret;
+}
+
+bool bloom_is_filter(const char* msg, size_t len)
+{
+	return len >= sizeof(Bloom_header) && !memcmp(msg, BLOOM_MAGIC, 4);
+}
+
+/* Return value:
+ * The filter a frame carries, or NULL if the frame is malformed
+ * */
+Bloom* bloom_parse(const char* msg, size_t len)
+{
+	Bloom_header header;
+	Bloom* bf;
+
+	if (!bloom_is_filter(msg, len))
+		return NULL;
+
+	memcpy(&header, msg, sizeof(header));
+
+	if (header.nbits < 8 || (header.nbits & (header.nbits -1)) || !header.nhashes ||
+	    len -sizeof(header) != header.nbits/8)
+		return NULL;
+
+	bf = xmalloc(sizeof(*bf));
+	bf->nbits    = header.nbits;
+	bf->nhashes  = header.nhashes;
+	bf->n        = 0;
+	bf->capacity = 0;
+	bf->bits     = memdup(msg +sizeof(header), header.nbits/8);
+
+	return bf;
+}
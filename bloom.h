@@ -0,0 +1,36 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define BLOOM_MAGIC "BLM1"
+
+/* The set of patient ids a worker holds, as published to whoServer. Membership tests
+ * may report false positives (about 1% at capacity) but never false negatives. Ids
+ * compare case-insensitively. */
+typedef struct {
+	uint32_t nbits;      // A power of two
+	uint32_t nhashes;
+	size_t n;            // Ids added
+	size_t capacity;     // Ids the filter was sized for
+	uint8_t* bits;
+} Bloom;
+
+/* As sent, followed by the bits */
+typedef struct {
+	char     magic[4];
+	uint32_t nbits;
+	uint32_t nhashes;
+} Bloom_header;
+
+Bloom* bloom_init(size_t capacity);
+void   bloom_free(Bloom* bf);
+void   bloom_add(Bloom* bf, const char* id);
+bool   bloom_test(const Bloom* bf, const char* id);
+int    bloom_send(Bloom* bf, int fd);
+bool   bloom_is_filter(const char* msg, size_t len);
+Bloom* bloom_parse(const char* msg, size_t len);
+
+#endif
@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "tools.h"
+#include "cache.h"
+
+static void cache_unlink(Cache* c, Cache_entry* e);
+static void cache_push_front(Cache* c, Cache_entry* e);
+static void cache_remove(Cache* c, Cache_entry* e);
+
+static void cache_unlink(Cache* c, Cache_entry* e)
+{
+	if (e->prev) e->prev->next = e->next;
+	else         c->head = e->next;
+
+	if (e->next) e->next->prev = e->prev;
+	else         c->tail = e->prev;
+}
+
+static void cache_push_front(Cache* c, Cache_entry* e)
+{
+	e->prev = NULL;
+	e->next = c->head;
+
+	if (c->head) c->head->prev = e;
+	else         c->tail = e;
+
+	c->head = e;
+}
+
+static void cache_remove(Cache* c, Cache_entry* e)
+{
+	cache_unlink(c, e);
+	hashtable_remove(c->table, e->key);
+	c->size--;
+
+	free(e->key);
+	free(e->tag);
+	free(e->val);
+	free(e);
+}
+
+Cache* cache_init(size_t capacity)
+{
+	Cache* c = xcalloc(1, sizeof(*c));
+
+	c->table    = hashtable_init(capacity, hashtable_min_bucket_size());
+	c->capacity = capacity;
+	pthread_mutex_init(&c->mutex, NULL);
+
+	return c;
+}
+
+void cache_free(Cache* c)
+{
+	if (c) {
+		while (c->head)
+			cache_remove(c, c->head);
+
+		hashtable_free(c->table, NULL);
+		pthread_mutex_destroy(&c->mutex);
+		free(c);
+	}
+}
+
+/* Look up key and mark it as the most recently used. Keys are case-sensitive, as
+ * replies may echo the query's spelling, though the table ignores case.
+ * Return value:
+ * A copy of the value, or NULL if key is not cached. Either way epoch is set to the
+ * current epoch, to be handed to cache_put() along with the value once computed
+ * */
+char* cache_get(Cache* c, const char* key, unsigned long* epoch)
+{
+	Cache_entry* e;
+	char* val = NULL;
+
+	pthread_mutex_lock(&c->mutex);
+
+	*epoch = c->epoch;
+
+	if ((e = hashtable_find(c->table, key)) && !strcmp(e->key, key)) {
+		cache_unlink(c, e);
+		cache_push_front(c, e);
+		val = xstrdup(e->val);
+	}
+
+	pthread_mutex_unlock(&c->mutex);
+
+	return val;
+}
+
+/* Store val under key, evicting the least recently used entry if the cache is full.
+ * An entry whose key differs only in case is replaced. Nothing is stored if the cache
+ * has been invalidated since epoch */
+void cache_put(Cache* c, const char* key, const char* tag, const char* val,
+               unsigned long epoch)
+{
+	Cache_entry* e;
+
+	pthread_mutex_lock(&c->mutex);
+
+	if (epoch != c->epoch)
+		goto end;
+
+	if ((e = hashtable_find(c->table, key))) {
+		if (!strcmp(e->key, key))
+			goto end;
+		cache_remove(c, e);
+	}
+
+	if (c->size == c->capacity)
+		cache_remove(c, c->tail);
+
+	e = xmalloc(sizeof(*e));
+	e->key = xstrdup(key);
+	e->tag = tag ? xstrdup(tag) : NULL;
+	e->val = xstrdup(val);
+
+	hashtable_insert(c->table, e->key, e);
+	cache_push_front(c, e);
+	c->size++;
+
+end:
+	pthread_mutex_unlock(&c->mutex);
+}
+
+/* Drop the entries tagged with tag, in any case, and the untagged ones, which may
+ * depend on it */
+void cache_invalidate(Cache* c, const char* tag)
+{
+	Cache_entry* e;
+	Cache_entry* next;
+
+	pthread_mutex_lock(&c->mutex);
+
+	c->epoch++;
+
+	for (e = c->head; e; e = next) {
+		next = e->next;
+		if (!e->tag || !strcasecmp(e->tag, tag))
+			cache_remove(c, e);
+	}
+
+	pthread_mutex_unlock(&c->mutex);
+}
@@ -0,0 +1,38 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include "hashtable.h"
+
+typedef struct Cache_entry Cache_entry;
+
+struct Cache_entry {
+	char* key;
+	char* tag;          // Invalidated along with tag, or with anything if NULL
+	char* val;
+	Cache_entry* prev;  // Towards the most recently used entry
+	Cache_entry* next;
+};
+
+/* Thread-safe LRU cache of strings. Entries are tagged and dropped by tag. Every
+ * invalidation starts a new epoch; a value computed during an older epoch may be
+ * stale and is not stored. */
+typedef struct {
+	Hashtable* table;   // Key -> Cache_entry
+	Cache_entry* head;  // Most recently used
+	Cache_entry* tail;  // Least recently used, evicted first
+	size_t size;
+	size_t capacity;
+	unsigned long epoch;
+	pthread_mutex_t mutex;
+} Cache;
+
+Cache* cache_init(size_t capacity);
+void   cache_free(Cache* c);
+char*  cache_get(Cache* c, const char* key, unsigned long* epoch);
+void   cache_put(Cache* c, const char* key, const char* tag, const char* val,
+                 unsigned long epoch);
+void   cache_invalidate(Cache* c, const char* tag);
+
+#endif
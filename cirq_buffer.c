@@ -1,9 +1,25 @@
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include "cirq_buffer.h"
 
+static void* cirq_buffer_trypop(Cirq_buffer* cb);
+static void  cirq_buffer_wake(Cirq_buffer* cb, int n);
+
+static void cirq_buffer_wake(Cirq_buffer* cb, int n)
+{
+	atomic_fetch_add(&cb->signal, 1);
+
+	if (atomic_load(&cb->waiters))
+		syscall(SYS_futex, &cb->signal, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
 Cirq_buffer* cirq_buffer_init(size_t cb_size)
 {
-	Cirq_buffer* cb = calloc(1, sizeof(*cb));
+	Cirq_buffer* cb = aligned_alloc(CIRQ_CACHELINE, sizeof(*cb));
 
 	if (cb) {
 		cb->buffer = calloc(cb_size, sizeof(*cb->buffer));
@@ -11,7 +27,16 @@ Cirq_buffer* cirq_buffer_init(size_t cb_size)
 			free(cb);
 			return NULL;
 		}
+
+		for (size_t i = 0; i < cb_size; ++i)
+			atomic_init(&cb->buffer[i].seq, i);
+
 		cb->size = cb_size;
+		atomic_init(&cb->closed, false);
+		atomic_init(&cb->signal, 0);
+		atomic_init(&cb->waiters, 0);
+		atomic_init(&cb->cur, 0);
+		atomic_init(&cb->cur_pop, 0);
 	}
 
 	return cb;
@@ -23,27 +48,111 @@ void cirq_buffer_free(Cirq_buffer* cb)
 	free(cb);
 }
 
+/* Return value:
+ * 1 on success, 0 if the buffer is full
+ * */
 int cirq_buffer_push(Cirq_buffer* cb, void* entry)
 {
-	if (cb->n == cb->size)
-		return 0;
+	Cirq_cell* cell;
+	size_t pos = atomic_load_explicit(&cb->cur, memory_order_relaxed);
+	size_t seq;
+	intptr_t dif;
+
+	for (;;) {
+		cell = &cb->buffer[pos % cb->size];
+		seq  = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		dif  = (intptr_t)seq -(intptr_t)pos;
 
-	cb->buffer[cb->cur] = entry;
-	cb->n++;
-	cb->cur = (cb->cur +1) % cb->size;
+		// The cell is free on this lap. Claim it
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&cb->cur, &pos, pos +1,
+			                                          memory_order_relaxed,
+			                                          memory_order_relaxed))
+				break;
+		}
+		// The cell still holds last lap's entry
+		else if (dif < 0)
+			return 0;
+		else
+			pos = atomic_load_explicit(&cb->cur, memory_order_relaxed);
+	}
+
+	cell->entry = entry;
+	atomic_store_explicit(&cell->seq, pos +1, memory_order_release);
+
+	cirq_buffer_wake(cb, 1);
 
 	return 1;
 }
 
-void* cirq_buffer_pop(Cirq_buffer* cb)
+static void* cirq_buffer_trypop(Cirq_buffer* cb)
 {
-	void* entry = cb->buffer[cb->cur_pop];
+	Cirq_cell* cell;
+	size_t pos = atomic_load_explicit(&cb->cur_pop, memory_order_relaxed);
+	size_t seq;
+	intptr_t dif;
+	void* entry;
+
+	for (;;) {
+		cell = &cb->buffer[pos % cb->size];
+		seq  = atomic_load_explicit(&cell->seq, memory_order_acquire);
+		dif  = (intptr_t)seq -(intptr_t)(pos +1);
 
-	if (entry) {
-		cb->buffer[cb->cur_pop] = NULL;
-		cb->n--;
-		cb->cur_pop = (cb->cur_pop +1) % cb->size;
+		// The cell has been filled on this lap. Claim it
+		if (dif == 0) {
+			if (atomic_compare_exchange_weak_explicit(&cb->cur_pop, &pos, pos +1,
+			                                          memory_order_relaxed,
+			                                          memory_order_relaxed))
+				break;
+		}
+		// Not filled yet
+		else if (dif < 0)
+			return NULL;
+		else
+			pos = atomic_load_explicit(&cb->cur_pop, memory_order_relaxed);
 	}
 
+	entry = cell->entry;
+	atomic_store_explicit(&cell->seq, pos +cb->size, memory_order_release);
+
 	return entry;
 }
+
+/* Block until an entry is available and remove it from the buffer. Consumers only
+ * enter the kernel when the buffer is empty.
+ * Return value:
+ * The entry, or NULL once the buffer has been closed
+ * */
+void* cirq_buffer_pop(Cirq_buffer* cb)
+{
+	void* entry;
+	int signal;
+
+	for (;;) {
+		if ((entry = cirq_buffer_trypop(cb)))
+			return entry;
+
+		if (atomic_load(&cb->closed))
+			return NULL;
+
+		// Register as a waiter and look again before sleeping, so that a push
+		// racing with us either is seen here or changes signal and fails the wait
+		signal = atomic_load(&cb->signal);
+		atomic_fetch_add(&cb->waiters, 1);
+
+		if (!(entry = cirq_buffer_trypop(cb)) && !atomic_load(&cb->closed))
+			syscall(SYS_futex, &cb->signal, FUTEX_WAIT_PRIVATE, signal, NULL, NULL, 0);
+
+		atomic_fetch_sub(&cb->waiters, 1);
+
+		if (entry)
+			return entry;
+	}
+}
+
+/* Release every consumer blocked in cirq_buffer_pop() */
+void cirq_buffer_close(Cirq_buffer* cb)
+{
+	atomic_store(&cb->closed, true);
+	cirq_buffer_wake(cb, INT_MAX);
+}
@@ -1,17 +1,33 @@
 #ifndef CIRQ_BUFFER_H
 #define CIRQ_BUFFER_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#define CIRQ_CACHELINE 64
+
+/* Bounded lock-free multi-producer/multi-consumer queue. Every cell carries a sequence
+ * number telling producers and consumers whether it is free or filled for the lap
+ * they are on. */
+typedef struct {
+	atomic_size_t seq;
+	void* entry;
+} Cirq_cell;
+
 typedef struct {
-	void** buffer;
+	Cirq_cell* buffer;
 	size_t size;
-	size_t n;
-	size_t cur;
-	size_t cur_pop;
-} Cirq_buffer; 
+	atomic_bool closed;
+	atomic_int  signal;   // futex word, bumped on every push
+	atomic_int  waiters;  // Consumers sleeping on signal
+	_Alignas(CIRQ_CACHELINE) atomic_size_t cur;      // Next position to push
+	_Alignas(CIRQ_CACHELINE) atomic_size_t cur_pop;  // Next position to pop
+} Cirq_buffer;
 
 Cirq_buffer* cirq_buffer_init(size_t cb_size);
 void  cirq_buffer_free(Cirq_buffer* cb);
 int   cirq_buffer_push(Cirq_buffer* cb, void* entry);
 void* cirq_buffer_pop(Cirq_buffer* cb);
+void  cirq_buffer_close(Cirq_buffer* cb);
 
 #endif
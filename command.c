@@ -1,15 +1,18 @@
 #include <string.h>
+#include <stdlib.h>
+#include "tools.h"
 #include "command.h"
+#include "stats.h"
+
+static Command command[] = {
+	{ DISEASE_FREQUENCY,      "/diseaseFrequency",     4, 4, 2 },
+	{ TOPK_AGE_RANGES,        "/topk-AgeRanges",       6, 2, 4 },
+	{ SEARCH_PATIENT_RECORD,  "/searchPatientRecord",  2, 0, 0 },
+	{ NUM_PATIENT_ADMISSIONS, "/numPatientAdmissions", 4, 4, 2 },
+	{ NUM_PATIENT_DISCHARGES, "/numPatientDischarges", 4, 4, 2 }};
 
 Command* get_command(const char* command_name)
 {
-	static Command command[] = {
-		{ DISEASE_FREQUENCY,      "/diseaseFrequency",     4, 4 },
-		{ TOPK_AGE_RANGES,        "/topk-AgeRanges",       6, 2 },
-		{ SEARCH_PATIENT_RECORD,  "/searchPatientRecord",  2, 0 },
-		{ NUM_PATIENT_ADMISSIONS, "/numPatientAdmissions", 4, 4 },
-		{ NUM_PATIENT_DISCHARGES, "/numPatientDischarges", 4, 4 }};
-
 	for (int i = 0; i < LAST; ++i)
 		if (!strcmp(command_name, command[i].name))
 			return &command[i];
@@ -17,3 +20,42 @@ Command* get_command(const char* command_name)
 	return NULL;
 }
 
+Command* get_command_by_val(Command_val val)
+{
+	return val >= 0 && val < LAST ? &command[val] : NULL;
+}
+
+/* Append the reply to /topk-AgeRanges to sb, from the number of patients in each of
+ * the four age ranges: the k most populated ranges, as percentages of all the
+ * patients.
+ * Return value:
+ * 0 on success, -1 if k is not positive
+ * */
+int topk_age_ranges(int k, const int* count, Strbuf* sb)
+{
+	static const char* format[STATS_AGE_RANGES] = {
+		"0-20: %.0f%%\n", "0-40: %.0f%%\n", "0-60: %.0f%%\n", "60+: %.0f%%\n" };
+	int order[STATS_AGE_RANGES] = { 0, 1, 2, 3 };
+	int sum = 0;
+	int i, j, tmp;
+
+	if (k <= 0)
+		return -1;
+
+	// Insertion sort by decreasing count. Ranges of equal count keep their order
+	for (i = 1; i < STATS_AGE_RANGES; ++i)
+		for (j = i; j > 0 && count[order[j]] > count[order[j -1]]; --j) {
+			tmp = order[j];
+			order[j] = order[j -1];
+			order[j -1] = tmp;
+		}
+
+	for (i = 0; i < STATS_AGE_RANGES; ++i)
+		sum += count[i];
+
+	for (i = 0; i < k && i < STATS_AGE_RANGES; ++i)
+		strbuf_appendf(sb, format[order[i]],
+		               sum ? (count[order[i]]/(float)sum)*100 : 0);
+
+	return 0;
+}
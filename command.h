@@ -1,6 +1,10 @@
 #ifndef COMMAND_H
 #define COMMAND_H
 
+#include "strbuf.h"
+
+#define BATCH_PREFIX "/batch\n"   // Starts a request carrying a query per line
+
 typedef enum {
 	DISEASE_FREQUENCY = 0,
 	TOPK_AGE_RANGES,
@@ -15,8 +19,11 @@ typedef struct  {
 	const char* name;
 	const int mandargs;
 	const int cntrarg_pos;
+	const int datearg_pos;   // Start date, followed by the end date
 } Command;
 
 Command* get_command(const char* command_str);
+Command* get_command_by_val(Command_val val);
+int      topk_age_ranges(int k, const int* count, Strbuf* sb);
 
 #endif
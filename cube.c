@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "tools.h"
+#include "cube.h"
+
+static int  cube_cell_find(Vector* cells, int date);
+static void cube_viruses_free(void* viruses);
+static void cube_cells_free(void* cells);
+
+Cube* cube_init(void)
+{
+	Cube* cube = xmalloc(sizeof(*cube));
+
+	cube->countries = hashtable_init(100, hashtable_min_bucket_size());
+	cube->names     = vector_init();
+	pthread_rwlock_init(&cube->rwlock, NULL);
+
+	return cube;
+}
+
+void cube_free(Cube* cube)
+{
+	if (cube) {
+		hashtable_free(cube->countries, cube_viruses_free);
+		vector_free(cube->names, free);
+		pthread_rwlock_destroy(&cube->rwlock);
+		free(cube);
+	}
+}
+
+static void cube_viruses_free(void* viruses)
+{
+	hashtable_free(viruses, cube_cells_free);
+}
+
+static void cube_cells_free(void* cells)
+{
+	vector_free(cells, free);
+}
+
+/* Turn a dd-mm-yyyy date into an integer that orders like the date. Dates that do
+ * not exist, such as 31-02, are rejected: the workers would roll them over into the
+ * next month, so queries on them are left to the workers.
+ * Return value:
+ * The integer, or -1 if the string is not a valid date
+ * */
+int cube_date(const char* datestr)
+{
+	static const int mdays[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+	int d, m, y;
+	int n = -1;
+	bool leap;
+
+	if (!datestr || sscanf(datestr, "%d-%d-%d%n", &d, &m, &y, &n) != 3 ||
+	    datestr[n] != '\0')
+		return -1;
+
+	if (m < 1 || m > 12 || y < 0)
+		return -1;
+
+	leap = (y%4 == 0 && y%100 != 0) || y%400 == 0;
+	if (d < 1 || d > mdays[m -1] +(m == 2 && leap))
+		return -1;
+
+	return y*10000 +m*100 +d;
+}
+
+/* Store the admissions for a virus in a country on a date, replacing any stored
+ * before. The caller holds the write lock */
+void cube_set(Cube* cube, const char* country, const char* virus, int date,
+              const int count[STATS_AGE_RANGES])
+{
+	Hashtable* viruses;
+	Vector* cells;
+	Cube_cell* cell;
+	int pos;
+	int i;
+
+	if ((viruses = hashtable_find(cube->countries, country)) == NULL) {
+		viruses = hashtable_init(20, hashtable_min_bucket_size());
+		hashtable_insert(cube->countries, country, viruses);
+		vector_append(cube->names, xstrdup(country));
+	}
+
+	if ((cells = hashtable_find(viruses, virus)) == NULL) {
+		cells = vector_init();
+		hashtable_insert(viruses, virus, cells);
+	}
+
+	pos = cube_cell_find(cells, date);
+
+	if (pos < cells->size && ((Cube_cell*)cells->entry[pos])->date == date)
+		cell = cells->entry[pos];
+	else {
+		cell = xmalloc(sizeof(*cell));
+		cell->date = date;
+
+		// Keep the cells sorted by date
+		vector_append(cells, cell);
+		for (i = cells->size -1; i > pos; --i)
+			cells->entry[i] = cells->entry[i -1];
+		cells->entry[pos] = cell;
+	}
+
+	memcpy(cell->count, count, sizeof(cell->count));
+}
+
+/* Return value:
+ * The position of the first cell dated date or later
+ * */
+static int cube_cell_find(Vector* cells, int date)
+{
+	int lo = 0;
+	int hi = cells->size;
+	int mid;
+
+	while (lo < hi) {
+		mid = (lo +hi) /2;
+		if (((Cube_cell*)cells->entry[mid])->date < date)
+			lo = mid +1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* Sum the admissions for virus in a country between two dates, inclusive. The caller
+ * holds the read lock.
+ * Return value:
+ * 0 on success, -1 if nothing is known about the country
+ * */
+int cube_sum(Cube* cube, const char* country, const char* virus, int from, int until,
+             int count[STATS_AGE_RANGES])
+{
+	Hashtable* viruses;
+	Vector* cells;
+	Cube_cell* cell;
+	int i, j;
+
+	memset(count, 0, STATS_AGE_RANGES*sizeof(*count));
+
+	if ((viruses = hashtable_find(cube->countries, country)) == NULL)
+		return -1;
+
+	if ((cells = hashtable_find(viruses, virus)) == NULL)
+		return 0;
+
+	for (i = cube_cell_find(cells, from); i < cells->size; ++i) {
+		cell = cells->entry[i];
+		if (cell->date > until)
+			break;
+
+		for (j = 0; j < STATS_AGE_RANGES; ++j)
+			count[j] += cell->count[j];
+	}
+
+	return 0;
+}
+
+void cube_wrlock(Cube* cube)
+{
+	pthread_rwlock_wrlock(&cube->rwlock);
+}
+
+void cube_rdlock(Cube* cube)
+{
+	pthread_rwlock_rdlock(&cube->rwlock);
+}
+
+void cube_unlock(Cube* cube)
+{
+	pthread_rwlock_unlock(&cube->rwlock);
+}
@@ -0,0 +1,33 @@
+#ifndef CUBE_H
+#define CUBE_H
+
+#include <pthread.h>
+#include "hashtable.h"
+#include "vector.h"
+#include "stats.h"
+
+typedef struct {
+	int date;                       // yyyymmdd
+	int count[STATS_AGE_RANGES];     // Admissions per age range
+} Cube_cell;
+
+/* The workers' statistics, indexed by country, virus and date. Statistics describe
+ * all the admissions of a date, so storing them again replaces rather than adds. */
+typedef struct {
+	Hashtable* countries;   // Country -> Hashtable of virus -> Vector of Cube_cells
+	Vector* names;          // The countries in order of arrival
+	pthread_rwlock_t rwlock;
+} Cube;
+
+Cube* cube_init(void);
+void  cube_free(Cube* cube);
+void  cube_set(Cube* cube, const char* country, const char* virus, int date,
+                const int count[STATS_AGE_RANGES]);
+int   cube_sum(Cube* cube, const char* country, const char* virus, int from, int until,
+               int count[STATS_AGE_RANGES]);
+int   cube_date(const char* datestr);
+void  cube_wrlock(Cube* cube);
+void  cube_rdlock(Cube* cube);
+void  cube_unlock(Cube* cube);
+
+#endif
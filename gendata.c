@@ -0,0 +1,432 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "tools.h"
+
+#define DATESTR_LEN   sizeof("dd-mm-yyyy")
+#define FILE_BUF_SIZE (1 << 20)
+#define AGE_STDDEV    20
+
+struct CLA {
+	char*  output_dir;
+	int    countries;
+	int    days;
+	int    rows;            // Admissions per country per day
+	int    start_year;
+	int    exit_percent;    // Of the admissions, how many are discharged later on
+	int    max_stay;        // Days
+	int    errors;          // Malformed lines per million rows
+	int    mean_age;
+	double virus_skew;      // Zipf exponent of the virus popularity
+	int    seed;
+};
+
+/* An admission waiting for its discharge */
+typedef struct {
+	uint64_t id;
+	uint16_t fname;
+	uint16_t lname;
+	uint8_t  virus;
+	uint8_t  age;
+} Stay;
+
+/* The stays ending on a day */
+typedef struct {
+	Stay*  stay;
+	size_t size;
+	size_t capacity;
+} Stay_list;
+
+typedef struct {
+	unsigned long long admissions;
+	unsigned long long discharges;
+	unsigned long long errors;
+} Totals;
+
+static void print_usage(char* progname);
+static void parse_cla(int argc, char** argv);
+static double getdouble(const char* numstr);
+
+static uint64_t rand_next(void);
+static double   rand_unit(void);
+static int      rand_age(void);
+static int      rand_virus(const double* cdf);
+
+static char* date_strings(void);
+static void  gen_country(int country, const char* dates, const double* virus_cdf,
+                         uint64_t* next_id, Totals* totals);
+static void  gen_error(FILE* fp, uint64_t* next_id, uint64_t last_id);
+static void  stay_append(Stay_list* list, const Stay* stay);
+
+static struct CLA g_cla;
+static uint64_t g_rand_state;
+
+static const char* g_country[] = {
+	"Greece", "Italy", "France", "Germany", "Brazil", "Australia", "Spain", "Portugal",
+	"China", "India", "Japan", "Canada", "Mexico", "Argentina", "Egypt", "Nigeria",
+	"Kenya", "Sweden", "Norway", "Finland", "Poland", "Turkey", "Russia", "Chile",
+	"Peru", "Vietnam", "Thailand", "Indonesia", "Morocco", "Ireland" };
+
+static const char* g_virus[] = {
+	"COVID-2019", "SARS-COV-2", "H1N1", "EVD", "FLU-2018", "MERS-COV", "SARS-1" };
+
+static const char* g_fname[] = {
+	"Mildrid", "Yukiko", "Hisashi", "Hertz", "Jane", "Debora", "Gernold", "Maria",
+	"Nikos", "Eleni", "Giorgos", "Anna", "Kostas", "Sofia", "Dimitris", "Ioanna",
+	"John", "Paul", "Laura", "Marco", "Giulia", "Pierre", "Claire", "Hans", "Greta",
+	"Joao", "Ana", "Liam", "Olivia", "Noah", "Emma", "Lucas", "Mia", "Ahmed", "Fatima",
+	"Wei", "Mei", "Raj", "Priya", "Kenji" };
+
+static const char* g_lname[] = {
+	"Suchindran", "Geurts", "Melville", "Diggle", "Raveling", "Smith", "Shera",
+	"Batain", "Papadopoulos", "Georgiou", "Nikolaou", "Rossi", "Bianchi", "Martin",
+	"Bernard", "Muller", "Schmidt", "Silva", "Santos", "Garcia", "Lopez", "Brown",
+	"Wilson", "Taylor", "Nguyen", "Tanaka", "Sato", "Kumar", "Singh", "Wang", "Li",
+	"Chen", "Kowalski", "Novak", "Yilmaz", "Ivanov", "Hansen", "Johansson", "Murphy",
+	"Kelly" };
+
+#define ARRAY_SIZE(arr) (sizeof(arr)/sizeof(*(arr)))
+
+static void print_usage(char* progname)
+{
+	fprintf(stderr, "%s -o outputDir [-c countries] [-d days] [-r rowsPerDay] "
+	        "[-y startYear] [-x exitPercent] [-l maxStay] [-e errorsPerMillion] "
+	        "[-a meanAge] [-z virusSkew] [-s seed]\n", progname);
+	exit(EXIT_FAILURE);
+}
+
+static void parse_cla(int argc, char** argv)
+{
+	int i;
+
+	if (argc < 3 || argc%2 == 0)
+		print_usage(argv[0]);
+
+	g_cla.countries    = 6;
+	g_cla.days         = 30;
+	g_cla.rows         = 100;
+	g_cla.start_year   = 2020;
+	g_cla.exit_percent = 50;
+	g_cla.max_stay     = 30;
+	g_cla.errors       = 0;
+	g_cla.mean_age     = 45;
+	g_cla.virus_skew   = 1;
+	g_cla.seed         = 1;
+
+	for (i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "-o"))
+			g_cla.output_dir = argv[++i];
+
+		else if (!strcmp(argv[i], "-c"))
+			g_cla.countries = getint(argv[++i], 0);
+
+		else if (!strcmp(argv[i], "-d"))
+			g_cla.days = getint(argv[++i], 0);
+
+		else if (!strcmp(argv[i], "-r"))
+			g_cla.rows = getint(argv[++i], 0);
+
+		else if (!strcmp(argv[i], "-y"))
+			g_cla.start_year = getint(argv[++i], 0);
+
+		else if (!strcmp(argv[i], "-x"))
+			g_cla.exit_percent = getint(argv[++i], 0);
+
+		else if (!strcmp(argv[i], "-l"))
+			g_cla.max_stay = getint(argv[++i], 0);
+
+		else if (!strcmp(argv[i], "-e"))
+			g_cla.errors = getint(argv[++i], 0);
+
+		else if (!strcmp(argv[i], "-a"))
+			g_cla.mean_age = getint(argv[++i], 0);
+
+		else if (!strcmp(argv[i], "-z"))
+			g_cla.virus_skew = getdouble(argv[++i]);
+
+		else if (!strcmp(argv[i], "-s"))
+			g_cla.seed = getint(argv[++i], 0);
+
+		else {
+			fprintf(stderr, "Unknown argument %s:\n", argv[i]);
+			print_usage(argv[0]);
+		}
+	}
+
+	if (!g_cla.output_dir)
+		print_usage(argv[0]);
+
+	if (g_cla.countries <= 0)
+		err_exit("Invalid number of countries");
+
+	if (g_cla.days <= 0)
+		err_exit("Invalid number of days");
+
+	if (g_cla.rows < 0)
+		err_exit("Invalid number of rows per day");
+
+	if (g_cla.start_year < 1900 || g_cla.start_year > 9999)
+		err_exit("Invalid start year");
+
+	if (g_cla.exit_percent < 0 || g_cla.exit_percent > 100)
+		err_exit("Invalid exit percentage");
+
+	if (g_cla.max_stay <= 0)
+		err_exit("Invalid maximum stay");
+
+	if (g_cla.errors < 0 || g_cla.errors > 1000000)
+		err_exit("Invalid error rate");
+
+	if (g_cla.mean_age <= 0 || g_cla.mean_age > 120)
+		err_exit("Invalid mean age");
+
+	if (g_cla.virus_skew < 0)
+		err_exit("Invalid virus skew");
+}
+
+static double getdouble(const char* numstr)
+{
+	char* endptr;
+	double num;
+
+	errno = 0;
+	num = strtod(numstr, &endptr);
+	if (errno || endptr == numstr || *endptr != '\0')
+		err_exit("Not a number: %s", numstr);
+
+	return num;
+}
+
+/* xorshift64*. Fast and, given the seed, the same on every machine */
+static uint64_t rand_next(void)
+{
+	g_rand_state ^= g_rand_state >> 12;
+	g_rand_state ^= g_rand_state << 25;
+	g_rand_state ^= g_rand_state >> 27;
+
+	return g_rand_state * 2685821657736338717ULL;
+}
+
+/* Return value:
+ * A number in [0, 1)
+ * */
+static double rand_unit(void)
+{
+	return (rand_next() >> 11) * (1.0 / (1ULL << 53));
+}
+
+/* Normally distributed around the mean age, within the 1-120 the parser accepts */
+static int rand_age(void)
+{
+	double u1 = 1 -rand_unit();
+	double u2 = rand_unit();
+	int age = g_cla.mean_age +AGE_STDDEV * sqrt(-2*log(u1)) * cos(2*M_PI*u2) +0.5;
+
+	return age < 1 ? 1 : age > 120 ? 120 : age;
+}
+
+static int rand_virus(const double* cdf)
+{
+	double u = rand_unit();
+	int i;
+
+	for (i = 0; i < (int)ARRAY_SIZE(g_virus) -1; ++i)
+		if (u < cdf[i])
+			break;
+
+	return i;
+}
+
+/* Return value:
+ * The names of the record files, DATESTR_LEN bytes apart, one per day from the first
+ * of January of the start year
+ * */
+static char* date_strings(void)
+{
+	char* dates = xmalloc(g_cla.days * DATESTR_LEN);
+	struct tm tm;
+	int i;
+
+	for (i = 0; i < g_cla.days; ++i) {
+		memset(&tm, 0, sizeof(tm));
+		tm.tm_year  = g_cla.start_year -1900;
+		tm.tm_mday  = 1 +i;
+		tm.tm_hour  = 12;
+		tm.tm_isdst = -1;
+
+		if (mktime(&tm) == -1)
+			err_exit("Dates out of range");
+
+		strftime(dates +i*DATESTR_LEN, DATESTR_LEN, "%d-%m-%Y", &tm);
+	}
+
+	return dates;
+}
+
+static void stay_append(Stay_list* list, const Stay* stay)
+{
+	if (list->size == list->capacity) {
+		list->capacity = list->capacity ? list->capacity*2 : 64;
+		list->stay = xrealloc(list->stay, list->capacity * sizeof(*list->stay));
+	}
+
+	list->stay[list->size++] = *stay;
+}
+
+/* Write a line the parser rejects: one too short, an exit of an unknown patient, a
+ * second admission of a patient or an age out of range */
+static void gen_error(FILE* fp, uint64_t* next_id, uint64_t last_id)
+{
+	const char* fname = g_fname[rand_next() % ARRAY_SIZE(g_fname)];
+	const char* lname = g_lname[rand_next() % ARRAY_SIZE(g_lname)];
+	const char* virus = g_virus[rand_next() % ARRAY_SIZE(g_virus)];
+
+	switch (rand_next() % 4) {
+	case 0:
+		fprintf(fp, "%llu ENTER %s %s\n", (unsigned long long)(*next_id)++,
+		        fname, lname);
+		break;
+	case 1:
+		fprintf(fp, "%llu EXIT %s %s %s %d\n", (unsigned long long)(*next_id)++,
+		        fname, lname, virus, rand_age());
+		break;
+	case 2:
+		if (last_id) {
+			fprintf(fp, "%llu ENTER %s %s %s %d\n", (unsigned long long)last_id,
+			        fname, lname, virus, rand_age());
+			break;
+		}
+		// No patient to admit twice yet
+		// fall through
+	default:
+		fprintf(fp, "%llu ENTER %s %s %s %d\n", (unsigned long long)(*next_id)++,
+		        fname, lname, virus, 121 +(int)(rand_next() % 30));
+		break;
+	}
+}
+
+/* Write the record files of a country. Each day's file holds the discharges due
+ * that day followed by the day's admissions, with error lines mixed in. Patients
+ * still in hospital on the last day are never discharged */
+static void gen_country(int country, const char* dates, const double* virus_cdf,
+                        uint64_t* next_id, Totals* totals)
+{
+	Stay_list* ending = xcalloc(g_cla.max_stay +1, sizeof(*ending));
+	Stay_list* today;
+	Stay stay;
+	char* name;
+	char* dir;
+	char* path;
+	char* buf = xmalloc(FILE_BUF_SIZE);
+	FILE* fp;
+	uint64_t last_id = 0;
+	size_t j;
+	int day, i, len;
+
+	if (country < (int)ARRAY_SIZE(g_country))
+		name = xstrdup(g_country[country]);
+	else
+		xsprintf(&name, "Country%d", country +1);
+
+	xsprintf(&dir, "%s/%s", g_cla.output_dir, name);
+	if (mkdir(dir, 0755) && errno != EEXIST)
+		syserr_exit("Cannot create \"%s\"", dir);
+
+	for (day = 0; day < g_cla.days; ++day) {
+		xsprintf(&path, "%s/%s", dir, dates +day*DATESTR_LEN);
+		if ((fp = fopen(path, "w")) == NULL)
+			syserr_exit("Cannot create \"%s\"", path);
+		setvbuf(fp, buf, _IOFBF, FILE_BUF_SIZE);
+
+		// The list is reused max_stay +1 days later
+		today = &ending[day % (g_cla.max_stay +1)];
+		for (j = 0; j < today->size; ++j) {
+			stay = today->stay[j];
+			fprintf(fp, "%llu EXIT %s %s %s %d\n", (unsigned long long)stay.id,
+			        g_fname[stay.fname], g_lname[stay.lname], g_virus[stay.virus],
+			        stay.age);
+		}
+		totals->discharges += today->size;
+		today->size = 0;
+
+		for (i = 0; i < g_cla.rows; ++i) {
+			if (g_cla.errors && rand_next() % 1000000 < (uint64_t)g_cla.errors) {
+				gen_error(fp, next_id, last_id);
+				totals->errors++;
+			}
+
+			stay.id    = (*next_id)++;
+			stay.fname = rand_next() % ARRAY_SIZE(g_fname);
+			stay.lname = rand_next() % ARRAY_SIZE(g_lname);
+			stay.virus = rand_virus(virus_cdf);
+			stay.age   = rand_age();
+
+			fprintf(fp, "%llu ENTER %s %s %s %d\n", (unsigned long long)stay.id,
+			        g_fname[stay.fname], g_lname[stay.lname], g_virus[stay.virus],
+			        stay.age);
+			last_id = stay.id;
+
+			if (rand_next() % 100 < (uint64_t)g_cla.exit_percent) {
+				len = 1 +rand_next() % g_cla.max_stay;
+				if (day +len < g_cla.days)
+					stay_append(&ending[(day +len) % (g_cla.max_stay +1)], &stay);
+			}
+		}
+		totals->admissions += g_cla.rows;
+
+		if (fclose(fp))
+			syserr_exit("Cannot write \"%s\"", path);
+		free(path);
+	}
+
+	for (i = 0; i <= g_cla.max_stay; ++i)
+		free(ending[i].stay);
+	free(ending);
+	free(buf);
+	free(dir);
+	free(name);
+}
+
+int main(int argc, char** argv)
+{
+	double virus_cdf[ARRAY_SIZE(g_virus)];
+	double sum = 0;
+	uint64_t next_id = 1;
+	Totals totals = { 0 };
+	char* dates;
+	int i;
+
+	parse_cla(argc, argv);
+
+	g_rand_state = 0x9E3779B97F4A7C15ULL ^ (uint64_t)g_cla.seed;
+	if (!g_rand_state)
+		g_rand_state = 1;
+
+	// The i-th most common virus is 1/(i+1)^skew as common as the first
+	for (i = 0; i < (int)ARRAY_SIZE(g_virus); ++i)
+		sum += virus_cdf[i] = pow(i +1, -g_cla.virus_skew);
+	for (i = 0; i < (int)ARRAY_SIZE(g_virus); ++i)
+		virus_cdf[i] = (i ? virus_cdf[i -1] : 0) +virus_cdf[i]/sum;
+
+	if (mkdir(g_cla.output_dir, 0755) && errno != EEXIST)
+		syserr_exit("Cannot create \"%s\"", g_cla.output_dir);
+
+	dates = date_strings();
+
+	for (i = 0; i < g_cla.countries; ++i)
+		gen_country(i, dates, virus_cdf, &next_id, &totals);
+
+	printf("%d countries, %d days: %llu admissions, %llu discharges, %llu error lines\n",
+	       g_cla.countries, g_cla.days, totals.admissions, totals.discharges,
+	       totals.errors);
+
+	free(dates);
+
+	return 0;
+}
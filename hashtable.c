@@ -2,9 +2,11 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include "hashtable.h"
 
 #define HASHTABLE_MIN_BUCKET_SIZE (sizeof(Bucket) +sizeof(Keyval))
+#define HASHTABLE_MAX_LOAD 2   // Entries per bucket slot before the index is doubled
 
 typedef struct Bucket Bucket;
 
@@ -25,14 +27,17 @@ struct Hashtable {
 	Bucket* cur_bucket;
 	int i;          // Hashtable index
 	int bi;         // Bucket index
+	bool traversing; // A traversal is under way
 };
 
-static int hashtable_hash(Hashtable* ht, const char* key);
+static size_t hashtable_hash(const char* key, size_t size);
+static void   hashtable_grow(Hashtable* ht);
 
 static Bucket* bucket_init(size_t size);
 static void    bucket_free(Bucket* b, void (*free_val)(void*));
 static int     bucket_insert(Bucket* b, const char* key, void* val);
 static void*   bucket_find(Bucket* b, const char* key);
+static void*   bucket_remove(Bucket* b, const char* key, bool* found);
 static Keyval* bucket_next(Bucket** b, int* i);
 
 char* hashtable_error(Hashtable_errcode errcode)
@@ -54,16 +59,81 @@ int hashtable_min_bucket_size(void)
 	return (int)HASHTABLE_MIN_BUCKET_SIZE;
 }
 
-static int hashtable_hash(Hashtable* ht, const char* key)
+/* FNV-1a over the lowercased key, as keys compare case-insensitively */
+static size_t hashtable_hash(const char* key, size_t size)
 {
-	size_t len = strlen(key);
-	int num = 0;
-	int i;
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (; *key; ++key) {
+		hash ^= (unsigned char)tolower(*key);
+		hash *= 1099511628211ULL;
+	}
+
+	return hash % size;
+}
+
+/* Double the index once the buckets are loaded past HASHTABLE_MAX_LOAD, so that
+ * lookups stay short however many entries the table was sized for. The entries are
+ * moved along with their keys. If memory runs out the table is left as it was. Not
+ * done while a traversal is under way, which would lose its place */
+static void hashtable_grow(Hashtable* ht)
+{
+	Bucket** table;
+	Bucket* b;
+	Bucket* next;
+	Bucket* dst;
+	size_t size = ht->size*2;
+	size_t hash;
+	size_t i;
+	int j;
+
+	if (ht->n < ht->size*ht->bsize*HASHTABLE_MAX_LOAD || ht->traversing)
+		return;
+
+	if ((table = calloc(size, sizeof(*table))) == NULL)
+		return;
+
+	for (i = 0; i < ht->size; ++i)
+		for (b = ht->table[i]; b; b = b->next)
+			for (j = 0; j < b->n; ++j) {
+				hash = hashtable_hash(b->entry[j].key, size);
+
+				// Keys are unique already, so the entry goes to the last bucket
+				if (!table[hash] && !(table[hash] = bucket_init(ht->bsize)))
+					goto nomem;
+
+				for (dst = table[hash]; dst->next; dst = dst->next)
+					;
+				if (dst->n == dst->size) {
+					if (!(dst->next = bucket_init(ht->bsize)))
+						goto nomem;
+					dst = dst->next;
+				}
+
+				dst->entry[dst->n++] = b->entry[j];
+			}
+
+	for (i = 0; i < ht->size; ++i)
+		for (b = ht->table[i]; b; b = next) {
+			next = b->next;
+			free(b->entry);
+			free(b);
+		}
+
+	free(ht->table);
+	ht->table = table;
+	ht->size  = size;
 
-	for (i = 0; i < len; ++i)
-		num += tolower(key[i]);
+	return;
 
-	return num % ht->size;
+nomem:
+	for (i = 0; i < size; ++i)
+		for (b = table[i]; b; b = next) {
+			next = b->next;
+			free(b->entry);
+			free(b);
+		}
+	free(table);
 }
 
 static Bucket* bucket_init(size_t size)
@@ -91,7 +161,7 @@ static void bucket_free(Bucket* b, void (*free_val)(void*))
 
 	if (b) {
 		do {
-			for (int i = 0; i < b->size; ++i) {
+			for (int i = 0; i < b->n; ++i) {
 				free(b->entry[i].key);
 				if (free_val)
 					free_val(b->entry[i].val);
@@ -166,6 +236,36 @@ done:
 		return NULL;
 }
 
+/* Remove the entry with the specified key from the bucket chain. The bucket's last
+ * entry takes the place of the removed one.
+ *
+ * Return value:
+ *
+ * The value of the removed entry. found is set to whether the key existed.
+ */
+static void* bucket_remove(Bucket* b, const char* key, bool* found)
+{
+	void* val;
+
+	*found = false;
+
+	do {
+		for (int i = 0; i < b->n; ++i)
+			if (!strcasecmp(b->entry[i].key, key)) {
+				val = b->entry[i].val;
+				free(b->entry[i].key);
+
+				b->entry[i] = b->entry[b->n -1];
+				b->n--;
+				*found = true;
+
+				return val;
+			}
+	} while ((b = b->next));
+
+	return NULL;
+}
+
 static Keyval* bucket_next(Bucket** b, int* i)
 {
 	Keyval* kv;
@@ -200,6 +300,7 @@ Hashtable* hashtable_init(size_t size, size_t bsize)
 		ht->i  = 0;
 		ht->bi = 0;
 		ht->cur_bucket = NULL;
+		ht->traversing = false;
 		ht->n     = 0;
 		ht->size  = size;
 		ht->bsize = (bsize - HASHTABLE_MIN_BUCKET_SIZE)/sizeof(Keyval) +1;
@@ -225,10 +326,12 @@ size_t hashtable_nentries(Hashtable* ht)
 
 int hashtable_insert(Hashtable* ht, const char* key, void* val)
 {
-	int hash;
+	size_t hash;
 	int ret;
 
-	hash = hashtable_hash(ht, key);
+	hashtable_grow(ht);
+
+	hash = hashtable_hash(key, ht->size);
 	if (ht->table[hash] == 0) {
 		ht->table[hash] = bucket_init(ht->bsize);
 		if (!ht->table[hash])
@@ -244,20 +347,40 @@ int hashtable_insert(Hashtable* ht, const char* key, void* val)
 
 void* hashtable_find(Hashtable* ht, const char* key)
 {
-	int hash;
+	size_t hash;
 
-	hash = hashtable_hash(ht, key);
+	hash = hashtable_hash(key, ht->size);
 	if (ht->table[hash] == 0)
 		return NULL;
 
 	return bucket_find(ht->table[hash], key);
 }
 
+/* Must not be called while traversing the table with hashtable_next() */
+void* hashtable_remove(Hashtable* ht, const char* key)
+{
+	bool found;
+	void* val;
+	size_t hash;
+
+	hash = hashtable_hash(key, ht->size);
+	if (ht->table[hash] == 0)
+		return NULL;
+
+	val = bucket_remove(ht->table[hash], key, &found);
+	if (found)
+		ht->n--;
+
+	return val;
+}
+
 Keyval* hashtable_next(Hashtable* ht)
 {
 	int* i = &ht->i;
 	Keyval* kv;
 
+	ht->traversing = true;
+
 	while (*i < ht->size) {
 		if (!ht->cur_bucket)
 			ht->cur_bucket = ht->table[*i];
@@ -270,9 +393,17 @@ Keyval* hashtable_next(Hashtable* ht)
 	}
 
 	// After traversing the whole hash table reset counters
+	hashtable_iter_reset(ht);
+
+	return NULL;
+}
+
+/* Abandon a traversal before hashtable_next() has returned NULL. The next call
+ * starts over from the first entry and the table may grow again */
+void hashtable_iter_reset(Hashtable* ht)
+{
 	ht->i  = 0;
 	ht->bi = 0;
 	ht->cur_bucket = NULL;
-
-	return NULL;
+	ht->traversing = false;
 }
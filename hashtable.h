@@ -21,7 +21,9 @@ Hashtable* hashtable_init(size_t size, size_t bsize);
 void  hashtable_free(Hashtable* ht, void (*free_val)(void*));
 int   hashtable_insert(Hashtable* ht, const char* key, void* val);
 void* hashtable_find(Hashtable* ht, const char* key);
+void* hashtable_remove(Hashtable* ht, const char* key);
 Keyval* hashtable_next(Hashtable* ht);
+void  hashtable_iter_reset(Hashtable* ht);
 size_t hashtable_nentries(Hashtable* ht);
 
 #endif
@@ -0,0 +1,117 @@
+#include <stdlib.h>
+#include "tools.h"
+#include "hist.h"
+
+static int      hist_bucket(uint64_t val);
+static uint64_t hist_bucket_max(int bucket);
+
+Hist* hist_init(void)
+{
+	Hist* h = xcalloc(1, sizeof(*h));
+
+	h->min = UINT64_MAX;
+
+	return h;
+}
+
+void hist_free(Hist* h)
+{
+	free(h);
+}
+
+/* Values below HIST_SUB get a bucket each. Above that, every power of two is split
+ * into HIST_SUB/2 buckets by the HIST_SUB_BITS most significant bits of the value */
+static int hist_bucket(uint64_t val)
+{
+	int msb;
+	int shift;
+
+	if (val < HIST_SUB)
+		return val;
+
+	msb   = 63 -__builtin_clzll(val);
+	shift = msb -(HIST_SUB_BITS -1);
+
+	return shift*(HIST_SUB/2) +(val >> shift);
+}
+
+/* Return value:
+ * The largest value that falls in bucket
+ * */
+static uint64_t hist_bucket_max(int bucket)
+{
+	int shift;
+	uint64_t top;
+
+	if (bucket < HIST_SUB)
+		return bucket;
+
+	shift = bucket/(HIST_SUB/2) -1;
+	top   = bucket%(HIST_SUB/2) +HIST_SUB/2;
+
+	return ((top +1) << shift) -1;
+}
+
+void hist_record(Hist* h, uint64_t val)
+{
+	h->count[hist_bucket(val)]++;
+	h->n++;
+	h->sum += val;
+
+	if (val < h->min)
+		h->min = val;
+	if (val > h->max)
+		h->max = val;
+}
+
+void hist_merge(Hist* dst, const Hist* src)
+{
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; ++i)
+		dst->count[i] += src->count[i];
+
+	dst->n   += src->n;
+	dst->sum += src->sum;
+
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/* Return value:
+ * The value at or below which p percent of the values lie, rounded up to the end of
+ * its bucket but never past the largest value recorded. 0 if the histogram is empty
+ * */
+uint64_t hist_percentile(const Hist* h, double p)
+{
+	uint64_t rank;
+	uint64_t seen = 0;
+	uint64_t val;
+	int i;
+
+	if (!h->n)
+		return 0;
+
+	rank = p/100 * h->n +0.5;
+	if (rank < 1)
+		rank = 1;
+	if (rank > h->n)
+		rank = h->n;
+
+	for (i = 0; i < HIST_BUCKETS; ++i) {
+		seen += h->count[i];
+		if (seen >= rank)
+			break;
+	}
+
+	val = hist_bucket_max(i);
+
+	return val < h->max ? val : h->max;
+}
+
+double hist_mean(const Hist* h)
+{
+	return h->n ? h->sum/h->n : 0;
+}
@@ -0,0 +1,30 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define HIST_SUB_BITS 5                           // 16 buckets per power of two
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((64 -HIST_SUB_BITS +1) * HIST_SUB/2 +HIST_SUB/2)
+
+/* Log-linear histogram of non-negative values, such as latencies. Values below
+ * HIST_SUB are counted exactly; larger ones fall in buckets no wider than 1/16 of
+ * their value, so percentiles come within about 6% of the true ones in constant
+ * memory. Not thread-safe; keep one per thread and merge them. */
+typedef struct {
+	uint64_t count[HIST_BUCKETS];
+	uint64_t n;
+	uint64_t min;
+	uint64_t max;
+	double   sum;
+} Hist;
+
+Hist*    hist_init(void);
+void     hist_free(Hist* h);
+void     hist_record(Hist* h, uint64_t val);
+void     hist_merge(Hist* dst, const Hist* src);
+uint64_t hist_percentile(const Hist* h, double p);
+double   hist_mean(const Hist* h);
+
+#endif
@@ -54,6 +54,27 @@ int list_append(List* list, void* data)
 	return 0;
 }
 
+/* Remove the list's first node and return its data */
+void* list_pop(List* list)
+{
+	List_node* node = list->head;
+	void* data;
+
+	if (!node)
+		return NULL;
+
+	data = node->data;
+
+	list->head = node->next;
+	if (!list->head)
+		list->tail = NULL;
+	list->size--;
+
+	list_node_free(node, NULL);
+
+	return data;
+}
+
 static List_node* list_node_init(void* data)
 {
 	List_node* node = malloc(sizeof(*node));
@@ -22,6 +22,7 @@ typedef struct {
 List* list_init(void);
 void  list_free(List* list, void (*free_data)(void*));
 int   list_append(List* list, void* data);
+void* list_pop(List* list);
 char* list_error(List_errcode errcode);
 
 #endif
@@ -6,7 +6,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -14,6 +17,9 @@
 #include <fcntl.h>
 #include <libgen.h>
 #include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "patient.h"
 #include "tools.h"
 #include "vector.h"
@@ -22,8 +28,16 @@
 #include "fifo.h"
 #include "msg.h"
 #include "command.h"
+#include "cirq_buffer.h"
+#include "stats.h"
+#include "strbuf.h"
+#include "bloom.h"
 
 #define BACKLOG 128
+#define QUERY_THREADS 4
+#define QUERY_QUEUE_SIZE 1024
+#define REPLY_CHUNK_SIZE 16384 // Bytes of reply rows gathered before they are sent
+#define SNAPSHOT_INTERVAL 60   // Minimum seconds between snapshots of a worker
 #define WORKER_FIFO_TEMPLATE "wfifo_%d"
 #define FIFO_TEMPLATE_LEN (sizeof(WORKER_FIFO_TEMPLATE) +16)
 
@@ -33,26 +47,115 @@ struct CLA {
 	char* input_dir;
 	char* srv_ip;
 	int   srv_port;
+	int   query_threads;
+	char* snapshot_dir;
+	bool  zygote;
+	int   max_shards;
 };
 
+/* A country, or a range of its dates, as assigned to a worker */
 typedef struct {
-	char* name;
-	bool parsed;
-} Record_file;
+	char* spec;     // "country", or "country\tfrom\tuntil" with * for an open bound
+	char* country;
+	off_t size;     // Size of the record files
+} Shard;
+
+typedef struct {
+	char* name;         // Names the snapshot, "country" or "country@from@until"
+	char* country;
+	char* path;         // input_dir/country
+	struct tm from;     // The shard holds the patients admitted in [from, until)
+	struct tm until;
+	bool has_from;
+	bool has_until;
+	Hashtable* known;   // Set of the record files seen so far, parsed or not
+	Vector* pending;    // Record files yet to be parsed
+	int wd;             // inotify watch on path
+	bool dirty;         // Files have been parsed since the last snapshot
+} Record_dir;
+
+typedef struct {
+	int fd;
+	Msg_reader* reader;
+	pthread_mutex_t write_mutex;  // Replies to pipelined requests may finish together
+	atomic_int refs;              // Held by the poll loop and by every pending query
+} Query_conn;
+
+typedef struct {
+	Query_conn* conn;
+	uint32_t reqid;
+	char* cmdline;
+} Query_job;
+
+/* A reply in chunks of whole rows, ended with an empty frame. The chunks are framed
+ * as they are produced and written out once the database has been released */
+typedef struct {
+	Query_conn* conn;
+	uint32_t reqid;
+	Strbuf* chunk;
+	Strbuf* out;    // The frames of the chunks filled so far
+} Reply_stream;
+
+struct query_handler_data {
+	Cirq_buffer* jobs;
+	PatientDB* db;
+	Vector* countries;
+};
+
+struct reload_data {
+	PatientDB* db;
+	Record_dir** recdirs;
+	int ndirs;
+	int inotify_fd;
+	struct sockaddr_in srv_addr;
+	int port;           // Where queries are taken, which names the worker to whoServer
+	Bloom* ids;         // The patient ids published to whoServer
+	atomic_bool stop;
+	time_t last_snapshot;
+};
 
 static void print_usage(char* progname);
 static void parse_cla(int argc, char** argv);
 
-static void  worker(const char* fifo);
-static char* worker_generate_stats(List* patients);
-
-static void  update_recordfiles(Vector* rec_files, const char* country);
-static char* parse_recordfiles(Vector* rec_files, PatientDB* db);
-static void  free_recordfiles(Vector* rec_files);
-static void  recordfile_free(Record_file* r);
-static inline void recordfile_free_generic(void* r);
+static void  worker(int id, const char* fifo);
+static void  worker_query(Reply_stream* rs, const char* cmdline, PatientDB* db,
+                          Vector* countries);
+static void  worker_generate_stats(List* patients, Stats* stats);
+static void* worker_reload_loop(void* data);
+static void  worker_reload(struct reload_data* rdata);
+static void  worker_load_snapshot(Record_dir* rd, PatientDB_delta* delta,
+                                  Stats* stats);
+static void  worker_save_snapshots(struct reload_data* rdata);
+static int   stats_cb(List* patients, void* cb_data);
+static void  worker_add_ids(Bloom* ids, PatientDB* db);
+
+static Query_conn* query_conn_init(int fd);
+static void  query_conn_put(Query_conn* conn);
+static inline void query_conn_put_generic(void* conn);
+static int   query_conn_serve(Query_conn* conn, struct query_handler_data* qdata);
+static void  reply_stream_init(Reply_stream* rs, Query_conn* conn, uint32_t reqid);
+static void  reply_stream_flush(Reply_stream* rs);
+static void  reply_stream_end(Reply_stream* rs);
+
+static void* query_handler(void* data);
+static void  query_job_run(Query_job* job, struct query_handler_data* qdata);
+
+static Record_dir* recorddir_init(const char* spec);
+static void  recorddir_free(Record_dir* rd);
+static inline void recorddir_free_generic(void* rd);
+static void  recorddir_watch(Record_dir* rd, int inotify_fd);
+static void  recorddir_add(Record_dir* rd, const char* path);
+static void  recorddir_mark(Record_dir* rd, const char* path);
+static void  recorddir_scan(Record_dir* rd);
+static int   recorddir_locate(Record_dir* rd, const char* path);
+static void  recorddir_notify(Record_dir** recdirs, int ndirs, int inotify_fd);
+static void  parse_recordfiles(Record_dir* rd, PatientDB_delta* delta, Stats* stats);
 static int   recordfile_date_comp(const void* v1, const void* v2);
-static int   recordfile_name_comp(const void* v1, const void* v2);
+
+static void zygote_load(Vector* shards, int* assign, int workers_num);
+static Vector* shards_init(Vector* countries);
+static void shard_free(void* shard);
+static void assign_shards(Vector* shards, int workers_num, int* assign);
 
 static void parent_signal_handler(int signum);
 static void worker_signal_handler(int signum);
@@ -69,12 +172,19 @@ volatile sig_atomic_t parent_sigchld;
 
 volatile sig_atomic_t worker_sigint;
 volatile sig_atomic_t worker_sigquit;
-volatile sig_atomic_t worker_sigusr1;
+
+// Queries read the worker's database concurrently, reloads modify it
+pthread_rwlock_t rwlock_db = PTHREAD_RWLOCK_INITIALIZER;
+
+// Data loaded by master before forking the workers, who share it copy-on-write
+PatientDB** g_zygote_db;    // One per worker
+Hashtable*  g_zygote_dirs;  // Shard spec -> Record_dir of the files loaded
 
 static void print_usage(char* progname)
 {
 	fprintf(stderr, "%s –w numWorkers -b bufferSize –s serverIP –p serverPort -i "
-	        "input_dir\n", progname);
+	        "input_dir [-t queryThreads] [-S snapshotDir] [-z] [-d maxShards]\n",
+	        progname);
 	exit(EXIT_FAILURE);
 }
 
@@ -85,6 +195,9 @@ static void parse_cla(int argc, char** argv)
 	if (argc < 7)
 		print_usage(argv[0]);
 
+	g_cla.query_threads = QUERY_THREADS;
+	g_cla.max_shards    = 1;
+
 	for (i = 1; i < argc; ++i) {
 		if (!strcmp(argv[i], "-w"))
 			g_cla.workers_num = getint(argv[++i], 0);
@@ -101,6 +214,18 @@ static void parse_cla(int argc, char** argv)
 		else if (!strcmp(argv[i], "-p"))
 			g_cla.srv_port = getint(argv[++i], 0);
 
+		else if (!strcmp(argv[i], "-t"))
+			g_cla.query_threads = getint(argv[++i], 0);
+
+		else if (!strcmp(argv[i], "-S"))
+			g_cla.snapshot_dir = argv[++i];
+
+		else if (!strcmp(argv[i], "-z"))
+			g_cla.zygote = true;
+
+		else if (!strcmp(argv[i], "-d"))
+			g_cla.max_shards = getint(argv[++i], 0);
+
 		else {
 			fprintf(stderr, "Unknown argument %s:\n", argv[i]);
 			print_usage(argv[0]);
@@ -112,6 +237,12 @@ static void parse_cla(int argc, char** argv)
 
 	if (g_cla.buffer_size <= 0)
 		err_exit("Invalid buffer size");
+
+	if (g_cla.query_threads <= 0)
+		err_exit("Invalid number of query threads");
+
+	if (g_cla.max_shards <= 0)
+		err_exit("Invalid number of shards");
 }
 
 /* Also used for sigquit */
@@ -150,14 +281,17 @@ int main(int argc, char** argv)
 {
 	parse_cla(argc, argv);
 
-	// Retrieve input directory's contents
+	// Retrieve input directory's contents and split the largest countries
 	Vector* countries = getdir(g_cla.input_dir, GETDIR_DEFAULT);
+	Vector* shards    = shards_init(countries);
 
 	// Create worker FIFOs
 	const int BUFFER_SIZE = g_cla.buffer_size;
-	const int WORKERS_NUM = (countries->size < g_cla.workers_num) ?
-							 countries->size : g_cla.workers_num;
+	const int WORKERS_NUM = (shards->size < g_cla.workers_num) ?
+							 shards->size : g_cla.workers_num;
 	pid_t pid[WORKERS_NUM];
+	int  assign[shards->size];
+	Shard* shard;
 	char worker_fifo[WORKERS_NUM][FIFO_TEMPLATE_LEN];
 	int  worker_fd[WORKERS_NUM];
 	struct sockaddr_in srv_addr;
@@ -180,6 +314,11 @@ int main(int argc, char** argv)
 	srv_addr.sin_port   = htons(g_cla.srv_port);
 	srv_addr.sin_addr   = srv_ip;
 
+	assign_shards(shards, WORKERS_NUM, assign);
+
+	if (g_cla.zygote)
+		zygote_load(shards, assign, WORKERS_NUM);
+
 	// Spawn workers
 	for (i = 0; i < WORKERS_NUM; ++i) {
 		switch ((pid[i] = fork())) {
@@ -187,7 +326,7 @@ int main(int argc, char** argv)
 			syserr_exit("fork()");
 
 		case 0:
-			worker(worker_fifo[i]);
+			worker(i, worker_fifo[i]);
 
 		default:
 			continue;
@@ -203,8 +342,10 @@ int main(int argc, char** argv)
 			syserr_exit("open()");
 
 	// Distribute the countries' subdirectories to the workers
-	for (i = 0; i < countries->size; ++i)
-		write_fifo(worker_fd[i % WORKERS_NUM], countries->entry[i], BUFFER_SIZE);
+	for (i = 0; i < shards->size; ++i) {
+		shard = shards->entry[i];
+		write_fifo(worker_fd[assign[i]], shard->spec, BUFFER_SIZE);
+	}
 
 	// Send an empty message to signify the end of the countries' message sequence.
 	// Send the address of whoServer
@@ -243,7 +384,7 @@ int main(int argc, char** argv)
 					syserr_exit("fork()");
 
 				case 0:
-					worker(worker_fifo[pos]);
+					worker(pos, worker_fifo[pos]);
 
 				default:
 					if (close(worker_fd[pos]) == -1)
@@ -253,10 +394,14 @@ int main(int argc, char** argv)
 						syserr_exit("open()");
 				}
 
-				for (i = 0; i < countries->size; ++i)
-					if (pos == (i % WORKERS_NUM))
-						write_fifo(worker_fd[pos], countries->entry[i], BUFFER_SIZE);
+				for (i = 0; i < shards->size; ++i) {
+					shard = shards->entry[i];
+					if (pos == assign[i])
+						write_fifo(worker_fd[pos], shard->spec, BUFFER_SIZE);
+				}
 				write_fifo(worker_fd[pos], "", BUFFER_SIZE);
+				write_fifo_raw(worker_fd[pos], &srv_addr, sizeof(srv_addr),
+				               BUFFER_SIZE);
 			}
 
 			g_termed_pid   = 0;
@@ -266,6 +411,14 @@ int main(int argc, char** argv)
 		}
 	}
 	vector_free(countries, free);
+	vector_free(shards, shard_free);
+
+	if (g_cla.zygote) {
+		hashtable_free(g_zygote_dirs, recorddir_free_generic);
+		for (i = 0; i < WORKERS_NUM; ++i)
+			patientDB_free(g_zygote_db[i]);
+		free(g_zygote_db);
+	}
 
 	// Close and unlink FIFOs
 	for (i = 0; i < WORKERS_NUM; ++i) {
@@ -291,8 +444,6 @@ static void worker_signal_handler(int signum)
 		worker_sigint  = 1;
 	else if (signum == SIGQUIT)
 		worker_sigquit = 1;
-	else if (signum == SIGUSR1)
-		worker_sigusr1 = 1;
 }
 
 static void worker_sigact(void)
@@ -304,7 +455,6 @@ static void worker_sigact(void)
 	sigemptyset(&maskset);
 	sigaddset(&maskset, SIGINT);
 	sigaddset(&maskset, SIGQUIT);
-	sigaddset(&maskset, SIGUSR1);
 
 	sigact.sa_handler = worker_signal_handler;
 	sigact.sa_mask  = maskset;
@@ -312,10 +462,18 @@ static void worker_sigact(void)
 
 	sigaction(SIGINT,  &sigact, NULL);
 	sigaction(SIGQUIT, &sigact, NULL);
-	sigaction(SIGUSR1, &sigact, NULL);
+
+	// SIGUSR1 stays pending until the reload thread accepts it with sigwait()
+	sigemptyset(&maskset);
+	sigaddset(&maskset, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &maskset, NULL);
+
+	// whoServer closing a connection mid-reply must not kill the worker
+	sigact.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sigact, NULL);
 }
 
-static void worker(const char* fifo)
+static void worker(int id, const char* fifo)
 {
 	const int BUFFER_SIZE = g_cla.buffer_size;
 	struct sockaddr_in srv_addr;
@@ -323,13 +481,12 @@ static void worker(const char* fifo)
 	socklen_t wrk_addrlen;
 	PatientDB* db;
 	Vector* countries;
+	Stats* stats;
 	char* msg;
-	char* stats;
 	char port_msg[11];
 	int master_fd;
 	int worker_fd;
 	int server_fd;
-	int accept_fd;
 	int i;
 
 	worker_sigact();
@@ -339,18 +496,34 @@ static void worker(const char* fifo)
 		syserr_exit("open()");
 
 
-	// Read assigned countries
-	countries = vector_init();
+	// Read assigned countries, whole or in date shards. A worker never holds two
+	// shards of the same country
+	Vector* shards = vector_init();
+
 	while (read_fifo(master_fd, &msg, BUFFER_SIZE))
-		vector_append(countries, msg);
+		vector_append(shards, msg);
 
 
-	// Fetch record files
-	Vector* recfiles[countries->size];
+	// Watch the country directories for new record files before the existing ones
+	// are fetched. A file showing up in between is seen twice and parsed once
+	Record_dir* recdirs[shards->size];
+	int inotify_fd;
 
-	for (i = 0; i < countries->size; ++i) {
-		recfiles[i] = vector_init();
-		update_recordfiles(recfiles[i], countries->entry[i]);
+	if ((inotify_fd = inotify_init1(IN_NONBLOCK)) == -1)
+		syserr_exit("inotify_init1()");
+
+	countries = vector_init();
+
+	for (i = 0; i < shards->size; ++i) {
+		recdirs[i] = NULL;
+		if (g_cla.zygote)
+			recdirs[i] = hashtable_remove(g_zygote_dirs, shards->entry[i]);
+		if (!recdirs[i])
+			recdirs[i] = recorddir_init(shards->entry[i]);
+
+		recorddir_watch(recdirs[i], inotify_fd);
+
+		vector_append(countries, xstrdup(recdirs[i]->country));
 	}
 
 
@@ -388,323 +561,1034 @@ static void worker(const char* fifo)
 	snprintf(port_msg, 11, "PORT:%d", ntohs(wrk_addr.sin_port));
 	write_msg(server_fd, port_msg);
 
+	// Advertise the assigned countries so that whoServer can route to this worker
+	// the queries concerning them
+	Strbuf* countries_msg = strbuf_init();
+
+	strbuf_append(countries_msg, "COUNTRIES:");
+	for (i = 0; i < shards->size; ++i) {
+		strbuf_append(countries_msg, shards->entry[i]);
+		strbuf_append(countries_msg, "\n");
+	}
+	write_msg(server_fd, countries_msg->buf);
+	strbuf_free(countries_msg);
 
-	// Sort record files by date, parse them, generate statistics and send them
-	// to the whoServer
-	db = patientDB_init();
 
-	for (i = 0; i < countries->size; ++i) {
-		vector_sort(recfiles[i], recordfile_date_comp);
-		stats = parse_recordfiles(recfiles[i], db);
-		if (stats) {
-			write_msg(server_fd, stats);
-			free(stats);
-		}
+	// Load the countries' snapshots, then sort the record files they do not cover by
+	// date and parse them. Generate statistics and send them to the whoServer. With
+	// a zygote the data loaded by master is already there and only needs statistics
+	PatientDB_delta* delta;
+
+	db = g_cla.zygote ? g_zygote_db[id] : patientDB_init();
+	delta = patientDB_delta_init(db);
+	stats = stats_init();
+	stats_stream(stats, server_fd);
+
+	for (i = 0; i < shards->size; ++i) {
+		if (g_cla.zygote)
+			patientDB_foreach_date(db, recdirs[i]->country, stats, stats_cb);
+		else if (g_cla.snapshot_dir)
+			worker_load_snapshot(recdirs[i], delta, stats);
+
+		recorddir_scan(recdirs[i]);
+		parse_recordfiles(recdirs[i], delta, stats);
+
+		// Full batches have gone out while parsing, the rest goes per directory
+		stats_send(stats, server_fd);
 	}
+	stats_free(stats);
+
+	patientDB_merge(delta);
+
+	// Publish the patient ids, so that whoServer only asks this worker for the ids
+	// it holds. The filter has room for the ids of later record files
+	Bloom* ids = bloom_init(2*hashtable_nentries(db->ids));
+
+	worker_add_ids(ids, db);
+	bloom_send(ids, server_fd);
+
 	// Send an empty message to signify the end of the message sequence
 	write_msg(server_fd, "");
 
-	// Read commands
-	Command* command;
-	char*    cmdline;
-	char*    cmdname;
-	Vector*  cmdarg;
+	// Serve queries. Every connection from whoServer is kept open and may carry any
+	// number of requests, each one answered with a frame bearing the request's id.
+	// This thread only waits for requests and queues them for the query threads
+	struct query_handler_data qdata;
+	struct reload_data rdata;
+	pthread_t qthread[g_cla.query_threads];
+	pthread_t rthread;
+	sigset_t blockset;
+	sigset_t oldmask;
+
+	qdata.jobs = cirq_buffer_init(QUERY_QUEUE_SIZE);
+	if (!qdata.jobs)
+		syserr_exit("cirq_buffer_init()");
+	qdata.db = db;
+	qdata.countries = countries;
+
+	// Signals are left to this thread, whose poll() they interrupt
+	sigfillset(&blockset);
+	pthread_sigmask(SIG_BLOCK, &blockset, &oldmask);
+
+	for (i = 0; i < g_cla.query_threads; ++i)
+		if (pthread_create(&qthread[i], NULL, query_handler, &qdata))
+			syserr_exit("pthread_create()");
+
+	// Record files are refreshed in the background while queries go on
+	rdata.db        = db;
+	rdata.recdirs   = recdirs;
+	rdata.ndirs     = shards->size;
+	rdata.inotify_fd = inotify_fd;
+	rdata.srv_addr  = srv_addr;
+	rdata.port      = ntohs(wrk_addr.sin_port);
+	rdata.ids       = ids;
+	rdata.last_snapshot = 0;
+	atomic_init(&rdata.stop, false);
+
+	if (pthread_create(&rthread, NULL, worker_reload_loop, &rdata))
+		syserr_exit("pthread_create()");
+
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+	Vector* conns = vector_init();
+	Query_conn* conn;
+	struct pollfd* pfd = NULL;
+	int npfd;
+	int accept_fd;
+	int j;
 
-	while ((accept_fd = accept(worker_fd, NULL, NULL)) || errno == EINTR)
+	for (;;)
 	{
+		npfd = conns->size +1;
+		pfd  = xrealloc(pfd, npfd*sizeof(*pfd));
+
+		pfd[0] = (struct pollfd){ .fd = worker_fd, .events = POLLIN };
+		for (j = 0; j < conns->size; ++j) {
+			conn = conns->entry[j];
+			pfd[j +1] = (struct pollfd){ .fd = conn->fd, .events = POLLIN };
+		}
+
+		if (poll(pfd, npfd, -1) == -1 && errno != EINTR)
+			syserr_exit("poll()");
+
 		// Termination signal received
 		if (worker_sigint || worker_sigquit)
 			break;
 
-		// Update record files and build stats
-		if (worker_sigusr1) {
-			int writes = 0;
+		// Serve the connections that have pending requests. Closed ones are dropped
+		// by moving the last connection into their slot
+		for (j = npfd -1; j > 0; --j) {
+			if (!pfd[j].revents)
+				continue;
 
-			if (connect(server_fd, (struct sockaddr *)&srv_addr,
-			            (socklen_t)sizeof(srv_addr)))
-				syserr_exit("connect()");
+			conn = conns->entry[j -1];
 
-			for (i = 0; i < countries->size; ++i)
-				update_recordfiles(recfiles[i], countries->entry[i]);
+			if (query_conn_serve(conn, &qdata) == -1) {
+				query_conn_put(conn);
+				conns->entry[j -1] = conns->entry[conns->size -1];
+				conns->size--;
+			}
+		}
 
-			for (i = 0; i < countries->size; ++i) {
-				vector_sort(recfiles[i], recordfile_date_comp);
-				stats = parse_recordfiles(recfiles[i], db);
-				if (stats) {
-					write_msg(server_fd, stats);
-					free(stats);
-					writes++;
-				}
+		if (pfd[0].revents & POLLIN) {
+			if ((accept_fd = accept(worker_fd, NULL, NULL)) == -1) {
+				if (errno != EINTR)
+					syserr_exit("accept()");
 			}
-			if (writes)
-				write_msg(server_fd, "");
+			else
+				vector_append(conns, query_conn_init(accept_fd));
+		}
+	}
 
-			worker_sigusr1 = 0;
-			continue;
+	// A reload in progress is completed first
+	atomic_store(&rdata.stop, true);
+	pthread_kill(rthread, SIGUSR1);
+
+	if (pthread_join(rthread, NULL))
+		syserr_exit("pthread_join()");
+
+	// Let the query threads finish whatever has been queued
+	cirq_buffer_close(qdata.jobs);
+
+	for (i = 0; i < g_cla.query_threads; ++i)
+		if (pthread_join(qthread[i], NULL))
+			syserr_exit("pthread_join()");
+
+	cirq_buffer_free(qdata.jobs);
+	vector_free(conns, query_conn_put_generic);
+	free(pfd);
+
+	for (i = 0; i < shards->size; ++i)
+		recorddir_free(recdirs[i]);
+	close(inotify_fd);
+	vector_free(shards, free);
+
+	vector_free(countries, free);
+	patientDB_free(db);
+	bloom_free(rdata.ids);
+
+	if (close(master_fd) == -1 || close(server_fd) == -1 || close(worker_fd) == -1)
+		syserr_exit("close()");
+
+	if (worker_sigquit) abort();
+
+	_exit(EXIT_SUCCESS);
+}
+
+static void* worker_reload_loop(void* data)
+{
+	struct reload_data* rdata = data;
+	struct signalfd_siginfo siginfo;
+	struct pollfd pfd[2];
+	sigset_t waitset;
+	int i;
+
+	// SIGUSR1 asks for a rescan of every directory. New files closed or moved into
+	// the directories are picked up as soon as they are complete
+	sigemptyset(&waitset);
+	sigaddset(&waitset, SIGUSR1);
+
+	if ((pfd[0].fd = signalfd(-1, &waitset, 0)) == -1)
+		syserr_exit("signalfd()");
+	pfd[1].fd = rdata->inotify_fd;
+	pfd[0].events = pfd[1].events = POLLIN;
+
+	// Snapshot whatever startup had to parse from the record files
+	worker_save_snapshots(rdata);
+
+	for (;;) {
+		if (poll(pfd, 2, -1) == -1) {
+			if (errno == EINTR) continue;
+			syserr_exit("poll()");
 		}
 
-		read_msg(accept_fd, &cmdline);
+		if (pfd[0].revents & POLLIN) {
+			if (read(pfd[0].fd, &siginfo, sizeof(siginfo)) == -1)
+				syserr_exit("read()");
 
-		cmdarg  = tokenize(cmdline, " \n");
-		cmdname = vector_get(cmdarg, 0);
+			if (atomic_load(&rdata->stop))
+				break;
 
-		// Empty command
-		if (!cmdname) {
-			vector_free(cmdarg, free);
-			free(cmdline);
-			close(accept_fd);
-			continue;
+			for (i = 0; i < rdata->ndirs; ++i)
+				recorddir_scan(rdata->recdirs[i]);
 		}
 
-		command = get_command(cmdname);
-
-		if (!command)
-			write_msg(accept_fd, "Unknown command\n");
-
-		else if (cmdarg->size < command->mandargs)
-			write_msg(accept_fd, "Please provide all the necessary arguments\n");
-
-		else if (command->val == DISEASE_FREQUENCY)
-		{
-			char* const virus      = vector_get(cmdarg, 1);
-			char* const start_date = vector_get(cmdarg, 2);
-			char* const end_date   = vector_get(cmdarg, 3);
-			char* const country    = vector_get(cmdarg, 4);
-			char freq_sum_str[16];
-			int freq_sum = 0;
-			int freq;
-
-			if (country)
-				freq_sum = patientDB_diseaseFreq(db, virus, start_date, end_date,
-												 country);
-			else {
-				for (i = 0; i < countries->size; ++i) {
-					freq = patientDB_diseaseFreq(db, virus, start_date, end_date,
-												 countries->entry[i]);
-					freq_sum += freq;
-
-					if (freq_sum == -1) break;
-				}
-			}
+		if (pfd[1].revents & POLLIN)
+			recorddir_notify(rdata->recdirs, rdata->ndirs, rdata->inotify_fd);
+
+		worker_reload(rdata);
+	}
+
+	close(pfd[0].fd);
+
+	return NULL;
+}
+
+/* Parse the record files that are pending since the last reload and send their
+ * statistics to whoServer. The files are parsed into a delta while queries keep
+ * running against the database, which is only write-locked to merge the delta */
+static void worker_reload(struct reload_data* rdata)
+{
+	PatientDB_delta* delta;
+	Vector* updated;
+	Stats* stats;
+	size_t nrecords;
+	size_t nids;
+	bool resize;
+	char* msg;
+	int server_fd;
+	int i;
+
+	for (i = 0; i < rdata->ndirs; ++i)
+		if (rdata->recdirs[i]->pending->size)
+			break;
 
-			snprintf(freq_sum_str, 16, "%d", freq_sum);
-			write_msg(accept_fd, freq_sum_str);
+	// Nothing new
+	if (i == rdata->ndirs)
+		return;
+
+	stats   = stats_init();
+	updated = vector_init();
+	delta   = patientDB_delta_init(rdata->db);
+
+	// A country's files may hold nothing but exits, which yield no statistics. The
+	// server is still told about the update, so that it drops its cached results
+	for (i = 0; i < rdata->ndirs; ++i) {
+		if (!rdata->recdirs[i]->pending->size)
+			continue;
+
+		nrecords = stats->nrecords;
+		parse_recordfiles(rdata->recdirs[i], delta, stats);
+
+		if (stats->nrecords == nrecords) {
+			xsprintf(&msg, "UPDATED:%s", rdata->recdirs[i]->country);
+			vector_append(updated, msg);
 		}
+	}
 
-		else if (command->val == TOPK_AGE_RANGES)
-		{
-			char* const k          = vector_get(cmdarg, 1);
-			char* const country    = vector_get(cmdarg, 2);
-			char* const virus      = vector_get(cmdarg, 3);
-			char* const start_date = vector_get(cmdarg, 4);
-			char* const end_date   = vector_get(cmdarg, 5);
-			char* stats = NULL;
-			bool  success = false;
-			int kval;
-			int err;
-
-			kval = getint(k, GETINT_NOEXIT, &err);
-			if (!err) {
-				stats = patientDB_topkAgeRanges(db, kval, country, virus, start_date,
-												end_date);
-				if (stats) {
-					write_msg(accept_fd, stats);
-					free(stats);
-					success = true;
-				}
-			}
+	// The filter takes the new ids, or is sized anew once it would fill up
+	nids = hashtable_nentries(delta->db->ids);
+	resize = (rdata->ids->n +nids > rdata->ids->capacity);
+	if (!resize)
+		worker_add_ids(rdata->ids, delta->db);
+
+	pthread_rwlock_wrlock(&rwlock_db);
+	patientDB_merge(delta);
+	pthread_rwlock_unlock(&rwlock_db);
+
+	if (resize) {
+		bloom_free(rdata->ids);
+		rdata->ids = bloom_init(2*hashtable_nentries(rdata->db->ids));
+		worker_add_ids(rdata->ids, rdata->db);
+	}
 
-			if (success == false)
-				write_msg(accept_fd, "");
+	if (time(NULL) -rdata->last_snapshot >= SNAPSHOT_INTERVAL)
+		worker_save_snapshots(rdata);
+
+	// Statistics go out once the data they describe can be queried, each batch over
+	// a connection of its own. The ids go first, as the statistics drop the cached
+	// results that were computed without them
+	if (stats->nrecords || updated->size || nids) {
+		if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+			syserr_exit("socket()");
+
+		if (connect(server_fd, (struct sockaddr *)&rdata->srv_addr,
+		            (socklen_t)sizeof(rdata->srv_addr)))
+			perror("connect()");
+		else {
+			xsprintf(&msg, "WORKER:%d", rdata->port);
+			write_msg(server_fd, msg);
+			free(msg);
+
+			if (nids)
+				bloom_send(rdata->ids, server_fd);
+
+			stats_send(stats, server_fd);
+			for (i = 0; i < updated->size; ++i)
+				write_msg(server_fd, updated->entry[i]);
+			write_msg(server_fd, "");
 		}
 
-		else if (command->val == SEARCH_PATIENT_RECORD)
-		{
-			char* const id = vector_get(cmdarg, 1);
-			Vector*  patients;
-			Patient* patient;
-			char*    patients_str = NULL;
-			char*    patient_str;
-
-			patients = vector_init();
-
-			for (i = 0; i < countries->size; ++i)
-				if ((patient = patientDB_get(db, countries->entry[i], id)))
-					vector_append(patients, patient);
-
-			xstrcat(&patients_str, "");
-			for (i = 0; i < patients->size; ++i) {
-				patient_print(patients->entry[i], &patient_str);
-				xstrcat(&patients_str, patient_str);
-				free(patient_str);
-			}
-			write_msg(accept_fd, patients_str);
+		close(server_fd);
+	}
+
+	stats_free(stats);
+	vector_free(updated, free);
+}
 
-			vector_free(patients, NULL);
-			free(patients_str);
+/* Split the countries into the shards assigned to the workers. A country larger than
+ * a worker's fair share of the input is split into date ranges of roughly equal size,
+ * up to maxShards of them. Each range is a run of consecutive record files and spans
+ * from the date of its first file up to, but not including, the date of the next
+ * range's first file */
+static Vector* shards_init(Vector* countries)
+{
+	Vector* shards = vector_init();
+	Vector* files[countries->size];
+	off_t  csize[countries->size];
+	off_t  total = 0;
+	off_t  acc;
+	struct stat st;
+	struct tm date;
+	Shard* shard;
+	char* from;
+	char* path;
+	off_t fsize;
+	int nfiles;
+	int i, j, k, g;
+
+	// Sum the size of every country's record files
+	for (i = 0; i < countries->size; ++i) {
+		xsprintf(&path, "%s/%s", g_cla.input_dir, (char*)countries->entry[i]);
+		files[i] = getdir(path, GETDIR_FULLPATH);
+		free(path);
+
+		csize[i] = 0;
+		for (j = 0; j < files[i]->size; ++j)
+			if (!stat(files[i]->entry[j], &st))
+				csize[i] += st.st_size;
+
+		total += csize[i];
+	}
+
+	for (i = 0; i < countries->size; ++i) {
+
+		// Only the files named after a date can be placed in a range
+		nfiles = 0;
+		for (j = 0; j < files[i]->size; ++j)
+			if (!date_init(basename(files[i]->entry[j]), &date))
+				files[i]->entry[nfiles++] = files[i]->entry[j];
+			else
+				free(files[i]->entry[j]);
+		files[i]->size = nfiles;
+
+		k = 1;
+		if (g_cla.max_shards > 1 && csize[i]*g_cla.workers_num > total) {
+			k = (csize[i]*g_cla.workers_num +total -1) /total;
+			if (k > g_cla.max_shards)  k = g_cla.max_shards;
+			if (k > g_cla.workers_num) k = g_cla.workers_num;
+			if (k > nfiles)            k = nfiles;
 		}
 
-		else if (command->val == NUM_PATIENT_ADMISSIONS)
-		{
-			char* const virus      = vector_get(cmdarg, 1);
-			char* const start_date = vector_get(cmdarg, 2);
-			char* const end_date   = vector_get(cmdarg, 3);
-			char* country          = vector_get(cmdarg, 4);
-			char* msg_total = NULL;
-			char* msg;
-
-			xstrcat(&msg_total, "");
-			if (country) {
-				msg = patientDB_admissions(db, country, virus, start_date, end_date);
-				if (msg) {
-					xstrcat(&msg_total, msg);
-					free(msg);
-				}
-			}
-			else {
-				for (i = 0; i < countries->size; ++i) {
-					country = countries->entry[i];
-					msg = patientDB_admissions(db, country, virus, start_date, end_date);
-					if (msg) {
-						xstrcat(&msg_total, msg);
-						free(msg);
-					}
-				}
-			}
-			write_msg(accept_fd, msg_total);
-			free(msg_total);
+		if (k <= 1) {
+			shard = xmalloc(sizeof(*shard));
+			shard->spec    = xstrdup(countries->entry[i]);
+			shard->country = xstrdup(countries->entry[i]);
+			shard->size    = csize[i];
+			vector_append(shards, shard);
+			vector_free(files[i], free);
+			continue;
 		}
 
-		else if (command->val == NUM_PATIENT_DISCHARGES)
-		{
-			char* const virus      = vector_get(cmdarg, 1);
-			char* const start_date = vector_get(cmdarg, 2);
-			char* const end_date   = vector_get(cmdarg, 3);
-			char* country          = vector_get(cmdarg, 4);
-			char* msg_total = NULL;
-			char* msg;
-
-			xstrcat(&msg_total, "");
-			if (country) {
-				msg = patientDB_discharges(db, country, virus, start_date, end_date);
-				if (msg) {
-					xstrcat(&msg_total, msg);
-					free(msg);
-				}
-			}
-			else {
-				for (i = 0; i < countries->size; ++i) {
-					country = countries->entry[i];
-					msg = patientDB_discharges(db, country, virus, start_date, end_date);
-					if (msg) {
-						xstrcat(&msg_total, msg);
-						free(msg);
-					}
-				}
+		vector_sort(files[i], recordfile_date_comp);
+
+		// Close a range once it has reached its share of the country, or once the
+		// files left are just enough for one per remaining range
+		from = "*";
+		acc  = 0;
+		g    = 0;
+		shard = xmalloc(sizeof(*shard));
+		shard->size = 0;
+
+		for (j = 0; j < nfiles; ++j) {
+			fsize = stat(files[i]->entry[j], &st) ? 0 : st.st_size;
+			acc += fsize;
+			shard->size += fsize;
+
+			if (g < k -1 && nfiles -j -1 >= k -1 -g &&
+			    (acc*k >= (g +1)*csize[i] || nfiles -j -1 == k -1 -g))
+			{
+				shard->country = xstrdup(countries->entry[i]);
+				xsprintf(&shard->spec, "%s\t%s\t%s", shard->country, from,
+				         basename(files[i]->entry[j +1]));
+				vector_append(shards, shard);
+
+				from = basename(files[i]->entry[j +1]);
+				g++;
+				shard = xmalloc(sizeof(*shard));
+				shard->size = 0;
 			}
-			write_msg(accept_fd, msg_total);
-			free(msg_total);
 		}
 
-		vector_free(cmdarg, free);
-		free(cmdline);
-		close(accept_fd);
+		// The files that are not dates go with the first range
+		if (csize[i] > acc)
+			((Shard*)shards->entry[shards->size -g])->size += csize[i] -acc;
+
+		shard->country = xstrdup(countries->entry[i]);
+		xsprintf(&shard->spec, "%s\t%s\t*", shard->country, from);
+		vector_append(shards, shard);
+
+		vector_free(files[i], free);
 	}
 
-	for (i = 0; i < countries->size; ++i)
-		free_recordfiles(recfiles[i]);
+	return shards;
+}
 
-	vector_free(countries, free);
-	patientDB_free(db);
+static void shard_free(void* shard)
+{
+	Shard* s = shard;
 
-	if (close(master_fd) == -1 || close(server_fd) == -1 || close(worker_fd) == -1)
-		syserr_exit("close()");
+	free(s->spec);
+	free(s->country);
+	free(s);
+}
 
-	if (worker_sigquit) abort();
+/* Assign the shards to the workers so that the workers' loads are as even as
+ * possible. The load of a shard is the size of its record files. The largest shard
+ * goes first, to the least loaded worker not holding another shard of the same
+ * country (LPT scheduling) */
+static void assign_shards(Vector* shards, int workers_num, int* assign)
+{
+	const int n = shards->size;
+	off_t load[workers_num];
+	int order[n];
+	Shard* shard;
+	int min;
+	int i, j, l, tmp;
+
+	for (i = 0; i < n; ++i)
+		order[i] = i;
+
+	// Insertion sort by decreasing size. Shards of equal size keep their order
+	for (i = 1; i < n; ++i)
+		for (j = i; j > 0 && ((Shard*)shards->entry[order[j]])->size >
+		                     ((Shard*)shards->entry[order[j -1]])->size; --j) {
+			tmp = order[j];
+			order[j] = order[j -1];
+			order[j -1] = tmp;
+		}
 
-	_exit(EXIT_SUCCESS);
+	for (i = 0; i < workers_num; ++i)
+		load[i] = 0;
+
+	for (i = 0; i < n; ++i) {
+		shard = shards->entry[order[i]];
+
+		// A country has no more shards than workers, so some worker is always free
+		min = -1;
+		for (j = 0; j < workers_num; ++j) {
+			for (l = 0; l < i; ++l)
+				if (assign[order[l]] == j &&
+				    !strcmp(((Shard*)shards->entry[order[l]])->country, shard->country))
+					break;
+
+			if (l == i && (min == -1 || load[j] < load[min]))
+				min = j;
+		}
+
+		assign[order[i]] = min;
+		load[min] += shard->size;
+	}
 }
 
-static char* parse_recordfiles(Vector* recfiles, PatientDB* db)
+/* Load and index the data of every shard once, in master, into the database of the
+ * worker it is assigned to. The forked workers start with it in place and their pages
+ * are shared until written. Snapshots are used when available and the statistics are
+ * generated by the workers themselves */
+static void zygote_load(Vector* shards, int* assign, int workers_num)
 {
-	Record_file* record_file;
-	List* patients_added;
-	char* stats_total = NULL;
-	char* stats;
+	PatientDB_delta* delta[workers_num];
+	Shard* shard;
+	Record_dir* rd;
 	int i;
 
-	for (i = 0; i < recfiles->size; i++) {
-		record_file = recfiles->entry[i];
+	g_zygote_db   = xmalloc(workers_num*sizeof(*g_zygote_db));
+	g_zygote_dirs = hashtable_init(100, hashtable_min_bucket_size());
+
+	for (i = 0; i < workers_num; ++i) {
+		g_zygote_db[i] = patientDB_init();
+		delta[i] = patientDB_delta_init(g_zygote_db[i]);
+	}
+
+	for (i = 0; i < shards->size; ++i) {
+		shard = shards->entry[i];
+		rd = recorddir_init(shard->spec);
 
-		if (record_file->parsed == false) {
-			patients_added = patient_parse_file(record_file->name, db);
-			if (patients_added) {
-				stats = worker_generate_stats(patients_added);
-				xstrcat(&stats_total, stats);
-				free(stats);
+		if (g_cla.snapshot_dir)
+			worker_load_snapshot(rd, delta[assign[i]], NULL);
+
+		recorddir_scan(rd);
+		parse_recordfiles(rd, delta[assign[i]], NULL);
+
+		hashtable_insert(g_zygote_dirs, shard->spec, rd);
+	}
+
+	for (i = 0; i < workers_num; ++i)
+		patientDB_merge(delta[i]);
+}
+
+/* Load a shard's snapshot, if there is one, and mark the record files it covers as
+ * parsed. The statistics of the patients loaded are added to stats, unless NULL */
+static void worker_load_snapshot(Record_dir* rd, PatientDB_delta* delta,
+                                 Stats* stats)
+{
+	Vector* files;
+	char* snapshot_path;
+	char* path;
+	int i;
+
+	xsprintf(&snapshot_path, "%s/%s.snap", g_cla.snapshot_dir, rd->name);
+	files = patientDB_snapshot_load(delta->db, rd->country, snapshot_path);
+	free(snapshot_path);
+
+	if (!files)
+		return;
+
+	for (i = 0; i < files->size; ++i) {
+		xsprintf(&path, "%s/%s", rd->path, (char*)files->entry[i]);
+		recorddir_mark(rd, path);
+		free(path);
+	}
+	vector_free(files, free);
+
+	// Statistics are generated from the loaded patients as they would have been from
+	// the record files, one entry date at a time
+	if (stats)
+		patientDB_foreach_date(delta->db, rd->country, stats, stats_cb);
+}
+
+static int stats_cb(List* patients, void* cb_data)
+{
+	worker_generate_stats(patients, cb_data);
+
+	return 0;
+}
+
+/* Add the ids of every patient in db to the filter */
+static void worker_add_ids(Bloom* ids, PatientDB* db)
+{
+	Keyval* kv;
+
+	while ((kv = hashtable_next(db->ids)))
+		bloom_add(ids, kv->key);
+}
+
+/* Snapshot the countries whose record files have changed since their last snapshot.
+ * Only this thread modifies the database, so it is read without locking */
+static void worker_save_snapshots(struct reload_data* rdata)
+{
+	Record_dir* rd;
+	Keyval* keyval;
+	Vector* files;
+	char* snapshot_path;
+	int i;
+
+	if (!g_cla.snapshot_dir)
+		return;
+
+	for (i = 0; i < rdata->ndirs; ++i) {
+		rd = rdata->recdirs[i];
+		if (!rd->dirty)
+			continue;
+
+		// The snapshot refers to the record files by name, the directory may move
+		files = vector_init();
+		while ((keyval = hashtable_next(rd->known)))
+			vector_append(files, keyval->key +strlen(rd->path) +1);
+
+		xsprintf(&snapshot_path, "%s/%s.snap", g_cla.snapshot_dir, rd->name);
+
+		if (!patientDB_snapshot_save(rdata->db, rd->country, files, snapshot_path))
+			rd->dirty = false;
+
+		free(snapshot_path);
+		vector_free(files, NULL);
+	}
+
+	rdata->last_snapshot = time(NULL);
+}
+
+static Query_conn* query_conn_init(int fd)
+{
+	Query_conn* conn = xmalloc(sizeof(*conn));
+
+	conn->fd = fd;
+	conn->reader = msg_reader_init(fd);
+	pthread_mutex_init(&conn->write_mutex, NULL);
+	atomic_init(&conn->refs, 1);
+
+	return conn;
+}
+
+/* Drop a reference to the connection. The last one closes it, so that the descriptor
+ * is not reused while a query is still to reply on it */
+static void query_conn_put(Query_conn* conn)
+{
+	if (atomic_fetch_sub(&conn->refs, 1) != 1)
+		return;
+
+	msg_reader_free(conn->reader);
+	pthread_mutex_destroy(&conn->write_mutex);
+	close(conn->fd);
+	free(conn);
+}
+
+static inline void query_conn_put_generic(void* conn)
+{
+	query_conn_put(conn);
+}
+
+/* Read whatever is available on the connection and queue every complete request.
+ * Return value:
+ * 0 if the connection should be kept, -1 if it has been closed by the peer or has
+ * sent a malformed frame
+ * */
+static int query_conn_serve(Query_conn* conn, struct query_handler_data* qdata)
+{
+	Query_job* job;
+	char*   cmdline;
+	ssize_t len;
+	int ret;
+
+	if (msg_reader_fill(conn->reader) == 0)
+		return -1;
+
+	while ((ret = msg_reader_next(conn->reader, &cmdline, &len)) == 1) {
+		job = xmalloc(sizeof(*job));
+		job->conn    = conn;
+		job->reqid   = conn->reader->id;
+		job->cmdline = cmdline;
+
+		atomic_fetch_add(&conn->refs, 1);
+
+		// With the queue full, the query runs here and slows down the intake
+		if (!cirq_buffer_push(qdata->jobs, job))
+			query_job_run(job, qdata);
+	}
+
+	return ret;
+}
+
+static void reply_stream_init(Reply_stream* rs, Query_conn* conn, uint32_t reqid)
+{
+	rs->conn  = conn;
+	rs->reqid = reqid;
+	rs->chunk = strbuf_init();
+	rs->out   = strbuf_init();
+}
+
+/* Frame the rows gathered so far once they fill a chunk */
+static void reply_stream_flush(Reply_stream* rs)
+{
+	if (rs->chunk->len < REPLY_CHUNK_SIZE)
+		return;
+
+	msg_append_id(rs->out, rs->reqid, rs->chunk->buf);
+	strbuf_clear(rs->chunk);
+}
+
+/* Write the reply: the framed chunks, the remaining rows unless there are none and
+ * the end of the reply. The connection is blocking, so all of it goes out */
+static void reply_stream_end(Reply_stream* rs)
+{
+	if (rs->chunk->len)
+		msg_append_id(rs->out, rs->reqid, rs->chunk->buf);
+	msg_append_id(rs->out, rs->reqid, "");
+
+	pthread_mutex_lock(&rs->conn->write_mutex);
+	msg_flush(rs->conn->fd, rs->out);
+	pthread_mutex_unlock(&rs->conn->write_mutex);
+
+	strbuf_free(rs->chunk);
+	strbuf_free(rs->out);
+}
+
+static void* query_handler(void* data)
+{
+	struct query_handler_data* qdata = data;
+	Query_job* job;
+
+	// A NULL job means the queue has been closed
+	while ((job = cirq_buffer_pop(qdata->jobs)))
+		query_job_run(job, qdata);
+
+	return NULL;
+}
+
+/* Run a query against the database, and write its reply once the database has been
+ * released, so that a slow reader does not hold up a reload */
+static void query_job_run(Query_job* job, struct query_handler_data* qdata)
+{
+	Reply_stream rs;
+
+	reply_stream_init(&rs, job->conn, job->reqid);
+
+	pthread_rwlock_rdlock(&rwlock_db);
+	worker_query(&rs, job->cmdline ? job->cmdline : "", qdata->db, qdata->countries);
+	pthread_rwlock_unlock(&rwlock_db);
+
+	reply_stream_end(&rs);
+
+	query_conn_put(job->conn);
+	free(job->cmdline);
+	free(job);
+}
+
+/* Execute a single query and gather its reply in rs. Long replies are split into
+ * chunks of whole rows */
+static void worker_query(Reply_stream* rs, const char* cmdline, PatientDB* db,
+                         Vector* countries)
+{
+	Command* command;
+	char*    cmdname;
+	Vector*  cmdarg;
+	int i;
+
+	cmdarg  = tokenize(cmdline, " \n");
+	cmdname = vector_get(cmdarg, 0);
+
+	// Empty command
+	if (!cmdname) {
+		vector_free(cmdarg, free);
+		return;
+	}
+
+	command = get_command(cmdname);
+
+	if (!command)
+		strbuf_append(rs->chunk, "Unknown command\n");
+
+	else if (cmdarg->size < command->mandargs)
+		strbuf_append(rs->chunk, "Please provide all the necessary arguments\n");
+
+	else if (command->val == DISEASE_FREQUENCY)
+	{
+		char* const virus      = vector_get(cmdarg, 1);
+		char* const start_date = vector_get(cmdarg, 2);
+		char* const end_date   = vector_get(cmdarg, 3);
+		char* const country    = vector_get(cmdarg, 4);
+		char freq_sum_str[16];
+		int freq_sum = 0;
+		int freq;
+
+		if (country)
+			freq_sum = patientDB_diseaseFreq(db, virus, start_date, end_date,
+											 country);
+		else {
+			for (i = 0; i < countries->size; ++i) {
+				freq = patientDB_diseaseFreq(db, virus, start_date, end_date,
+											 countries->entry[i]);
+				freq_sum += freq;
+
+				if (freq_sum == -1) break;
+			}
+		}
+
+		snprintf(freq_sum_str, 16, "%d", freq_sum);
+		strbuf_append(rs->chunk, freq_sum_str);
+	}
+
+	else if (command->val == TOPK_AGE_RANGES)
+	{
+		char* const k          = vector_get(cmdarg, 1);
+		char* const country    = vector_get(cmdarg, 2);
+		char* const virus      = vector_get(cmdarg, 3);
+		char* const start_date = vector_get(cmdarg, 4);
+		char* const end_date   = vector_get(cmdarg, 5);
+		int  count[STATS_AGE_RANGES];
+		int kval;
+		int err;
+
+		// The counts are merged across the workers sharing the country and the
+		// top k are picked by whoServer
+		kval = getint(k, GETINT_NOEXIT, &err);
+		if (!err && kval > 0 &&
+		    !patientDB_ageRanges(db, country, virus, start_date, end_date, count))
+			strbuf_appendf(rs->chunk, "%d %d %d %d", count[0], count[1], count[2],
+			               count[3]);
+	}
+
+	else if (command->val == SEARCH_PATIENT_RECORD)
+	{
+		char* const id = vector_get(cmdarg, 1);
+		Patient* patient;
+
+		// One lookup finds the id in every country held
+		for (patient = patientDB_getbyid(db, id); patient; patient = patient->id_next) {
+			patient_print(patient, rs->chunk);
+			reply_stream_flush(rs);
+		}
+	}
+
+	else if (command->val == NUM_PATIENT_ADMISSIONS)
+	{
+		char* const virus      = vector_get(cmdarg, 1);
+		char* const start_date = vector_get(cmdarg, 2);
+		char* const end_date   = vector_get(cmdarg, 3);
+		char* country          = vector_get(cmdarg, 4);
+
+		if (country)
+			patientDB_admissions(db, country, virus, start_date, end_date, rs->chunk);
+		else {
+			for (i = 0; i < countries->size; ++i) {
+				country = countries->entry[i];
+				patientDB_admissions(db, country, virus, start_date, end_date, rs->chunk);
+				reply_stream_flush(rs);
+			}
+		}
+	}
+
+	else if (command->val == NUM_PATIENT_DISCHARGES)
+	{
+		char* const virus      = vector_get(cmdarg, 1);
+		char* const start_date = vector_get(cmdarg, 2);
+		char* const end_date   = vector_get(cmdarg, 3);
+		char* country          = vector_get(cmdarg, 4);
+
+		if (country)
+			patientDB_discharges(db, country, virus, start_date, end_date, rs->chunk);
+		else {
+			for (i = 0; i < countries->size; ++i) {
+				country = countries->entry[i];
+				patientDB_discharges(db, country, virus, start_date, end_date, rs->chunk);
+				reply_stream_flush(rs);
 			}
-			record_file->parsed = true;
 		}
 	}
 
-	return stats_total;
+	vector_free(cmdarg, free);
 }
 
-static void update_recordfiles(Vector* rec_files, const char* country)
+/* Parse the pending record files of a directory in date order and add their
+ * statistics to stats, unless NULL. The files past the shard's range only hand over
+ * the exits of the patients it admitted */
+static void parse_recordfiles(Record_dir* rd, PatientDB_delta* delta, Stats* stats)
 {
-	Vector* rec_filenames;
-	char* country_path;
-	int pos, i;
+	List* patients_added;
+	char* path;
+	int i;
 
-	xsprintf(&country_path, "%s/%s", g_cla.input_dir, country);
-	rec_filenames = getdir(country_path, GETDIR_FULLPATH);
-	free(country_path);
+	if (rd->pending->size)
+		rd->dirty = true;
 
-	Record_file* rec_file;
-	Record_file  rec_file_new;
+	vector_sort(rd->pending, recordfile_date_comp);
 
-	for (i = 0; i < rec_filenames->size; ++i) {
-		rec_file_new.name = rec_filenames->entry[i];
+	for (i = 0; i < rd->pending->size; i++) {
+		path = rd->pending->entry[i];
 
-		pos = vector_find(rec_files, &rec_file_new, recordfile_name_comp);
-		if (pos == -1) {
-			rec_file         = xmalloc(sizeof(*rec_file));
-			rec_file->name   = xstrdup(rec_filenames->entry[i]);
-			rec_file->parsed = false;
-			vector_append(rec_files, rec_file);
+		switch (recorddir_locate(rd, path)) {
+		case -1:
+			patients_added = NULL;
+			break;
+		case 0:
+			patients_added = patient_parse_file(path, delta,
+			                          rd->has_from ? PARSE_NO_INVID : PARSE_DEFAULT);
+			break;
+		default:
+			patients_added = patient_parse_file(path, delta, PARSE_EXITS_ONLY);
 		}
+
+		if (patients_added && stats)
+			worker_generate_stats(patients_added, stats);
+		free(path);
 	}
+	rd->pending->size = 0;
+}
+
+/* Parse a shard's spec, "country" or "country\tfrom\tuntil" */
+static Record_dir* recorddir_init(const char* spec)
+{
+	Record_dir* rd = xmalloc(sizeof(*rd));
+	Vector* tok;
+	char* p;
+
+	tok = tokenize(spec, "\t");
+	rd->country   = xstrdup(tok->entry[0]);
+	rd->has_from  = tok->size == 3 && !date_init(tok->entry[1], &rd->from);
+	rd->has_until = tok->size == 3 && !date_init(tok->entry[2], &rd->until);
+	vector_free(tok, free);
+
+	rd->name = xstrdup(spec);
+	for (p = rd->name; *p; ++p)
+		if (*p == '\t')
+			*p = '@';
+
+	xsprintf(&rd->path, "%s/%s", g_cla.input_dir, rd->country);
+	rd->known   = hashtable_init(100, hashtable_min_bucket_size());
+	rd->pending = vector_init();
+	rd->dirty   = false;
+	rd->wd      = -1;
+
+	return rd;
+}
+
+static void recorddir_watch(Record_dir* rd, int inotify_fd)
+{
+	rd->wd = inotify_add_watch(inotify_fd, rd->path, IN_CLOSE_WRITE | IN_MOVED_TO);
+	if (rd->wd == -1)
+		perror("inotify_add_watch()");
+}
+
+static void recorddir_free(Record_dir* rd)
+{
+	hashtable_free(rd->known, NULL);
+	vector_free(rd->pending, free);
+	free(rd->country);
+	free(rd->name);
+	free(rd->path);
+	free(rd);
+}
+
+static inline void recorddir_free_generic(void* rd)
+{
+	recorddir_free(rd);
+}
+
+/* Queue a record file for parsing, unless it has been seen before */
+static void recorddir_add(Record_dir* rd, const char* path)
+{
+	if (hashtable_find(rd->known, path))
+		return;
 
-	vector_free(rec_filenames, free);
+	// Only the keys matter
+	hashtable_insert(rd->known, path, rd);
+	vector_append(rd->pending, xstrdup(path));
 }
 
-static void free_recordfiles(Vector* rec_files)
+/* Record a file as parsed without queueing it */
+static void recorddir_mark(Record_dir* rd, const char* path)
 {
-	vector_free(rec_files, recordfile_free_generic);
+	if (!hashtable_find(rd->known, path))
+		hashtable_insert(rd->known, path, rd);
 }
 
-static inline void recordfile_free_generic(void* r)
+static void recorddir_scan(Record_dir* rd)
 {
-	recordfile_free(r);
+	Vector* paths;
+	int i;
+
+	paths = getdir(rd->path, GETDIR_FULLPATH);
+
+	for (i = 0; i < paths->size; ++i)
+		recorddir_add(rd, paths->entry[i]);
+
+	vector_free(paths, free);
 }
 
-static void recordfile_free(Record_file* r)
+/* Place a record file relative to the shard's range.
+ * Return value:
+ * -1 if it precedes the range, 0 if it falls in it, 1 if it follows it. A file that
+ * is not named after a date belongs to the first range
+ * */
+static int recorddir_locate(Record_dir* rd, const char* path)
 {
-	free(r->name);
-	free(r);
+	struct tm date;
+	char* name;
+	int err;
+
+	name = xstrdup(path);
+	err  = date_init(basename(name), &date);
+	free(name);
+
+	if (err)
+		return rd->has_from ? -1 : 0;
+
+	if (rd->has_from && date_comp(&date, &rd->from) < 0)
+		return -1;
+
+	if (rd->has_until && date_comp(&date, &rd->until) >= 0)
+		return 1;
+
+	return 0;
 }
 
-static int recordfile_name_comp(const void* v1, const void* v2)
+/* Queue the files reported by inotify. Only names that are dates are record files;
+ * anything else (e.g. the temporary file of an editor) is ignored */
+static void recorddir_notify(Record_dir** recdirs, int ndirs, int inotify_fd)
 {
-	Record_file* r1 = (Record_file*)v1;
-	Record_file* r2 = (Record_file*)v2;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event* event;
+	struct tm date;
+	ssize_t bread;
+	char* path;
+	char* p;
+	int i;
+
+	while ((bread = read(inotify_fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf +bread; p += sizeof(*event) +event->len) {
+			event = (const struct inotify_event*)p;
+
+			if (!event->len || date_init(event->name, &date))
+				continue;
+
+			for (i = 0; i < ndirs; ++i) {
+				if (recdirs[i]->wd != event->wd)
+					continue;
+
+				xsprintf(&path, "%s/%s", recdirs[i]->path, event->name);
+				recorddir_add(recdirs[i], path);
+				free(path);
+				break;
+			}
+		}
+	}
 
-	return strcmp(r1->name, r2->name);
+	if (bread == -1 && errno != EAGAIN)
+		syserr_exit("read()");
 }
+
 static int recordfile_date_comp(const void* v1, const void* v2)
 {
-	Record_file* r1;
-	Record_file* r2;
 	struct tm date1;
 	struct tm date2;
 	char* date_str1;
@@ -712,11 +1596,8 @@ static int recordfile_date_comp(const void* v1, const void* v2)
 	char* rec_name1;
 	char* rec_name2;
 
-	r1 = *((Record_file**)v1);
-	r2 = *((Record_file**)v2);
-
-	rec_name1 = xstrdup(r1->name);
-	rec_name2 = xstrdup(r2->name);
+	rec_name1 = xstrdup(*(char**)v1);
+	rec_name2 = xstrdup(*(char**)v2);
 
 	date_str1 = basename(rec_name1);
 	date_str2 = basename(rec_name2);
@@ -730,23 +1611,16 @@ static int recordfile_date_comp(const void* v1, const void* v2)
 	return date_comp(&date1, &date2);
 }
 
-/* Generate stats for a specific country/date and place the resulting string in stats
- * Return value:
- * The number of bytes written to the returned sting
- * */
-static char* worker_generate_stats(List* patients)
+/* Add the statistics of the patients admitted in a country on a date to stats: their
+ * number per virus and age range */
+static void worker_generate_stats(List* patients, Stats* stats)
 {
-	struct Virus_frequency {
-		int upto20;
-		int upto40;
-		int upto60;
-		int plus60;
-	} *vir_freq;
-
 	List_node* node;
 	Hashtable* vir_freq_table;
-	Patient* patient;
+	Patient* patient = NULL;
 	Keyval* keyval;
+	int* vir_freq;
+	int date;
 
 	vir_freq_table = hashtable_init(20, hashtable_min_bucket_size());
 
@@ -754,49 +1628,27 @@ static char* worker_generate_stats(List* patients)
 		patient = node->data;
 		vir_freq = hashtable_find(vir_freq_table, patient->virus);
 		if (!vir_freq) {
-			vir_freq = xcalloc(1, sizeof(*vir_freq));
+			vir_freq = xcalloc(STATS_AGE_RANGES, sizeof(*vir_freq));
 			hashtable_insert(vir_freq_table, patient->virus, vir_freq);
 		}
 
 		if (patient->age <= 20)
-			vir_freq->upto20++;
+			vir_freq[0]++;
 		else if (patient->age <= 40)
-			vir_freq->upto40++;
+			vir_freq[1]++;
 		else if (patient->age <= 60)
-			vir_freq->upto60++;
+			vir_freq[2]++;
 		else
-			vir_freq->plus60++;
+			vir_freq[3]++;
 	}
 
-	const int BUFS_NUM = hashtable_nentries(vir_freq_table) +1;
-	char*  buf [BUFS_NUM];
-	size_t blen[BUFS_NUM];
-	char   date[DATE_BUFSIZE];
-	int i;
+	if (patient) {
+		date = (patient->entry_date.tm_year +1900)*10000 +
+		       (patient->entry_date.tm_mon +1)*100 +patient->entry_date.tm_mday;
 
-	date_tostring(&patient->entry_date, date);
-	blen[0] = xsprintf(&buf[0], "%s\n%s\n", date, patient->country);
-
-	for (i = 1; (keyval = hashtable_next(vir_freq_table)); ++i) {
-		vir_freq = keyval->val;
-
-		blen[i] = xsprintf(&buf[i],
-		          "%s\n"
-		          "Age range 0-20 years: %d cases\n"
-		          "Age range 21-40 years: %d cases\n"
-		          "Age range 41-60 years: %d cases\n"
-		          "Age range 60+ years: %d cases\n\n",
-		          keyval->key,
-		          vir_freq->upto20, vir_freq->upto40, vir_freq->upto60,
-		          vir_freq->plus60);
+		while ((keyval = hashtable_next(vir_freq_table)))
+			stats_add(stats, patient->country, keyval->key, date, keyval->val);
 	}
 
 	hashtable_free(vir_freq_table, free);
-
-	char* stats = string_arr_flatten(buf, blen, BUFS_NUM);
-
-	for (i = 0; i < BUFS_NUM; ++i)
-		free(buf[i]);
-
-	return stats;
 }
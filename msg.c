@@ -2,50 +2,213 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdbool.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
+#include <poll.h>
 #include "tools.h"
 #include "msg.h"
 
-#define HEADER_SIZE sizeof(size_t)
-#define BUFSIZE 1024
+#define HEADER_SIZE sizeof(Msg_header)
+#define READER_BUFSIZE 16384
+#define WRITE_TIMEOUT_MS 5000   // A non-blocking fd taking nothing for this long is given up
 
-static void   _write_msg(int fd, const void* mem, size_t memsize);
+typedef struct {
+	uint32_t len;   // Body length
+	uint32_t id;    // Request id, 0 when the frame is not part of a request
+} Msg_header;
+
+static int    _write_msg(int fd, struct iovec* iov, int iovcnt);
 static ssize_t _read_msg(int fd, void* mem, size_t memsize);
+static void   msg_reader_reserve(Msg_reader* r, size_t memsize);
+static inline bool conn_lost(int err);
+static inline bool header_valid(const Msg_header* header, uint32_t max_len);
+
+static inline bool conn_lost(int err)
+{
+	return err == EPIPE || err == ECONNRESET;
+}
+
+/* Every body holds at least its terminating NUL */
+static inline bool header_valid(const Msg_header* header, uint32_t max_len)
+{
+	return header->len > 0 && header->len <= max_len;
+}
+
+int write_msg(int fd, const char* msg)
+{
+	return write_msg_id(fd, 0, msg);
+}
+
+/* Write a frame tagged with a request id.
+ * Return value:
+ * 0 on success, -1 if the peer has closed the connection or stopped reading from it
+ * */
+int write_msg_id(int fd, uint32_t id, const char* msg)
+{
+	Msg_header header = { strlen(msg) +1, id };
+	struct iovec iov[2];
+
+	// Header (size) and body (msg) go out in a single syscall
+	iov[0].iov_base = &header;
+	iov[0].iov_len  = HEADER_SIZE;
+	iov[1].iov_base = (void*)msg;
+	iov[1].iov_len  = header.len;
+
+	return _write_msg(fd, iov, 2);
+}
+
+/* Append a frame tagged with a request id to out, to be sent by msg_flush() */
+void msg_append_id(Strbuf* out, uint32_t id, const char* msg)
+{
+	Msg_header header = { strlen(msg) +1, id };
+
+	strbuf_appendn(out, (const char*)&header, HEADER_SIZE);
+	strbuf_appendn(out, msg, header.len);
+}
+
+/* Write as much of out as a non-blocking fd takes right away, and drop it from out.
+ * Return value:
+ * 0 on success, even if some of out is left, -1 if the peer has closed the connection
+ * */
+int msg_flush(int fd, Strbuf* out)
+{
+	ssize_t bwritten;
 
-void write_msg(int fd, const char* msg)
+	while (out->len) {
+		bwritten = write(fd, out->buf, out->len);
+		if (bwritten == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (conn_lost(errno))
+				return -1;
+			syserr_exit("write() failure");
+		}
+
+		strbuf_drop(out, bwritten);
+	}
+
+	return 0;
+}
+
+/* Write the last chunk of a streamed reply followed by the empty frame that ends it,
+ * in a single syscall. An empty chunk is left out.
+ * Return value:
+ * Same as write_msg_id()
+ * */
+int write_msg_id_end(int fd, uint32_t id, const char* msg)
+{
+	Msg_header header[2] = { { strlen(msg) +1, id }, { 1, id } };
+	struct iovec iov[4];
+	int n = 0;
+
+	if (header[0].len > 1) {
+		iov[n].iov_base = &header[0];
+		iov[n++].iov_len  = HEADER_SIZE;
+		iov[n].iov_base = (void*)msg;
+		iov[n++].iov_len  = header[0].len;
+	}
+	iov[n].iov_base = &header[1];
+	iov[n++].iov_len  = HEADER_SIZE;
+	iov[n].iov_base = "";
+	iov[n++].iov_len  = 1;
+
+	return _write_msg(fd, iov, n);
+}
+
+/* Write a frame carrying binary data. It is NUL-terminated like any other frame, so
+ * it can be read with read_msg() and the reader, whose returned length is len.
+ * Return value:
+ * Same as write_msg_id()
+ * */
+int write_msg_buf(int fd, const void* buf, uint32_t len)
 {
-	size_t bodylen = strlen(msg) +1;
+	Msg_header header = { len +1, 0 };
+	struct iovec iov[3];
 
-	// Write header (size)
-	_write_msg(fd, &bodylen, HEADER_SIZE);
-	// Write body (msg)
-	_write_msg(fd, msg, bodylen);
+	iov[0].iov_base = &header;
+	iov[0].iov_len  = HEADER_SIZE;
+	iov[1].iov_base = (void*)buf;
+	iov[1].iov_len  = len;
+	iov[2].iov_base = "";
+	iov[2].iov_len  = 1;
+
+	return _write_msg(fd, iov, 3);
 }
 
-static void _write_msg(int fd, const void* mem, size_t memsize)
+/* Write out the iovecs in full. A non-blocking fd whose send buffer is full is
+ * waited on, so that frames are never cut short, but for no longer than
+ * WRITE_TIMEOUT_MS at a time: a peer that has stopped reading is treated as gone */
+static int _write_msg(int fd, struct iovec* iov, int iovcnt)
 {
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
 	ssize_t bwritten;
+	int ret;
+
+	while (iovcnt) {
+		bwritten = writev(fd, iov, iovcnt);
+		if (bwritten == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if ((ret = poll(&pfd, 1, WRITE_TIMEOUT_MS)) == -1 && errno != EINTR)
+					syserr_exit("poll() failure");
+				if (ret == 0)
+					return -1;
+				continue;
+			}
+			if (conn_lost(errno))
+				return -1;
+			syserr_exit("writev() failure");
+		}
+
+		// Skip whatever was written and retry with the remainder
+		while (iovcnt && bwritten >= iov->iov_len) {
+			bwritten -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char*)iov->iov_base +bwritten;
+			iov->iov_len -= bwritten;
+		}
+	}
 
-	bwritten = write(fd, mem, memsize);
-	if (bwritten == -1)
-		syserr_exit("write() failure");
-	if (bwritten < memsize)
-		err_exit("Partial write");
+	return 0;
 }
 
+/* Read a single frame without buffering anything past its end.
+ * Return value:
+ * The length of the string read, 0 for the empty string or -1 if the peer has closed
+ * the connection or sent a malformed frame
+ * */
 ssize_t read_msg(int fd, char** msg)
 {
-	size_t bodylen;
+	Msg_header header;
 	ssize_t bread;
 
+	*msg = NULL;
+
 	// Read header (size)
-	_read_msg(fd, &bodylen, HEADER_SIZE);
+	if (_read_msg(fd, &header, HEADER_SIZE) == -1)
+		return -1;
+
+	if (!header_valid(&header, MSG_MAX_LEN))
+		return -1;
 
-	*msg = xmalloc(bodylen);
+	// Read body (msg) straight into its final location
+	*msg = xmalloc(header.len);
 
-	bread = _read_msg(fd, *msg, bodylen);
+	bread = _read_msg(fd, *msg, header.len);
+	if (bread == -1) {
+		free(*msg);
+		*msg = NULL;
+		return -1;
+	}
 	bread -= 1;
 
 	// If the empty string was read, free it and return zero
@@ -59,45 +222,159 @@ ssize_t read_msg(int fd, char** msg)
 
 static ssize_t _read_msg(int fd, void* mem, size_t memsize)
 {
-	char buf[BUFSIZE];
 	ssize_t bread;
 	ssize_t bread_sum = 0;
-	size_t bufsize;
 
-	bufsize = (memsize <= BUFSIZE) ? memsize : BUFSIZE;
-
-	while ((bread = read(fd, buf, bufsize))) {
-		if (bread == -1)
+	while (bread_sum < memsize) {
+		bread = read(fd, (char*)mem +bread_sum, memsize -bread_sum);
+		if (bread == -1) {
+			if (errno == EINTR)
+				continue;
+			if (conn_lost(errno))
+				return -1;
 			syserr_exit("read() failure");
+		}
+		if (bread == 0)
+			return -1;
 
-		memcpy(mem +bread_sum, buf, bread);
 		bread_sum += bread;
+	}
 
-		if (bread_sum == memsize)
-			break;
+	return bread_sum;
+}
+
+Msg_reader* msg_reader_init(int fd)
+{
+	Msg_reader* r = xcalloc(1, sizeof(*r));
+
+	r->fd   = fd;
+	r->max_len = MSG_MAX_LEN;
+	r->size = READER_BUFSIZE;
+	r->buf  = xmalloc(r->size);
 
-		bufsize = (bufsize <= memsize -bread_sum) ? bufsize : memsize -bread_sum;
+	return r;
+}
+
+void msg_reader_free(Msg_reader* r)
+{
+	if (r) {
+		free(r->buf);
+		free(r);
 	}
+}
+
+/* Make room for at least memsize contiguous bytes starting at r->start */
+static void msg_reader_reserve(Msg_reader* r, size_t memsize)
+{
+	size_t buffered = r->end -r->start;
 
-	if (bread_sum < memsize)
-		err_exit("Partial read");
+	if (r->start +memsize <= r->size)
+		return;
 
-	return bread_sum;
+	if (r->start) {
+		memmove(r->buf, r->buf +r->start, buffered);
+		r->start = 0;
+		r->end   = buffered;
+	}
+
+	if (memsize > r->size) {
+		r->buf  = xrealloc(r->buf, memsize);
+		r->size = memsize;
+	}
 }
 
-/*
-static ssize_t _read_msg(int fd, void* mem, size_t memsize)
+/* Issue a single read() into the free space of the buffer.
+ * Return value:
+ * The number of bytes read, 0 on end-of-file or -1 if the call would block
+ * */
+ssize_t msg_reader_fill(Msg_reader* r)
 {
 	ssize_t bread;
-	ssize_t bread_sum = 0;
 
-	while (bread = read(fd, mem, memsize) != -1) {
-	}
-	if (bread == -1)
+	if (r->start == r->end)
+		r->start = r->end = 0;
+
+	if (r->end == r->size)
+		msg_reader_reserve(r, (r->start) ? r->end -r->start +1 : r->size*2);
+
+	for (;;) {
+		bread = read(r->fd, r->buf +r->end, r->size -r->end);
+		if (bread != -1)
+			break;
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return -1;
+		if (conn_lost(errno))
+			return 0;
 		syserr_exit("read() failure");
-	if (bread < memsize)
-		err_exit("Partial read");
+	}
+
+	r->end += bread;
 
 	return bread;
 }
-*/
+
+/* Extract the next complete frame from the buffer, if there is one. Like read_msg(),
+ * len is set to the length of the string and msg to NULL for the empty string.
+ * Return value:
+ * 1 if a frame was extracted, 0 if more data is needed, -1 if the next frame is
+ * malformed and the connection should be dropped
+ * */
+int msg_reader_next(Msg_reader* r, char** msg, ssize_t* len)
+{
+	size_t buffered = r->end -r->start;
+	Msg_header header;
+
+	if (buffered < HEADER_SIZE)
+		return 0;
+
+	memcpy(&header, r->buf +r->start, HEADER_SIZE);
+
+	if (!header_valid(&header, r->max_len))
+		return -1;
+
+	// Grow along with the bytes that have arrived rather than by what the header
+	// claims, so that a header alone cannot make the buffer take max_len
+	if (buffered < HEADER_SIZE +header.len) {
+		if (buffered*2 < HEADER_SIZE +header.len)
+			msg_reader_reserve(r, buffered*2);
+		else
+			msg_reader_reserve(r, HEADER_SIZE +header.len);
+		return 0;
+	}
+
+	*len = header.len -1;
+	if (*len)
+		*msg = memdup(r->buf +r->start +HEADER_SIZE, header.len);
+	else
+		*msg = NULL;
+
+	r->id = header.id;
+	r->start += HEADER_SIZE +header.len;
+
+	return 1;
+}
+
+/* Blocking counterpart of msg_reader_next(). A non-blocking fd is waited on.
+ * Return value:
+ * Same as read_msg()
+ * */
+ssize_t read_msg_buffered(Msg_reader* r, char** msg)
+{
+	struct pollfd pfd = { .fd = r->fd, .events = POLLIN };
+	ssize_t bread;
+	ssize_t len;
+	int ret;
+
+	*msg = NULL;
+
+	while ((ret = msg_reader_next(r, msg, &len)) == 0) {
+		if ((bread = msg_reader_fill(r)) == 0)
+			return -1;
+		if (bread == -1 && poll(&pfd, 1, -1) == -1 && errno != EINTR)
+			syserr_exit("poll() failure");
+	}
+
+	return (ret == -1) ? -1 : len;
+}
@@ -1,7 +1,36 @@
 #ifndef MSG_H
 #define MSG_H
 
-void   write_msg(int fd, const char* msg);
+#include <stdint.h>
+#include <sys/types.h>
+#include "strbuf.h"
+
+#define MSG_MAX_LEN (512u << 20)   // Largest frame body accepted, NUL included
+
+/* Per-connection receive buffer. A single read() may bring in several frames, which
+ * are then handed out one by one without touching the socket again. */
+typedef struct {
+	int fd;
+	char*  buf;
+	size_t size;    // Buffer capacity
+	size_t start;   // Offset of the first unconsumed byte
+	size_t end;     // Offset one past the last buffered byte
+	uint32_t id;    // Request id of the last extracted frame
+	uint32_t max_len;  // Largest frame body accepted, MSG_MAX_LEN unless lowered
+} Msg_reader;
+
+int    write_msg(int fd, const char* msg);
+int    write_msg_id(int fd, uint32_t id, const char* msg);
+int    write_msg_id_end(int fd, uint32_t id, const char* msg);
+int    write_msg_buf(int fd, const void* buf, uint32_t len);
 ssize_t read_msg(int fd, char** msg);
+void   msg_append_id(Strbuf* out, uint32_t id, const char* msg);
+int    msg_flush(int fd, Strbuf* out);
+
+Msg_reader* msg_reader_init(int fd);
+void    msg_reader_free(Msg_reader* r);
+ssize_t msg_reader_fill(Msg_reader* r);
+int     msg_reader_next(Msg_reader* r, char** msg, ssize_t* len);
+ssize_t read_msg_buffered(Msg_reader* r, char** msg);
 
 #endif
@@ -4,6 +4,11 @@
 #include <stdarg.h>
 #include <time.h>
 #include <libgen.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "tools.h"
 #include "tree.h"
 #include "patient.h"
@@ -14,6 +19,8 @@
 #define DATE_ISUNDEF(date)  ((date).tm_mon == -1)
 #define DATE_ISDEF(date)    ((date).tm_mon != -1)
 
+#define SNAPSHOT_MAGIC "PDBSNAP1"
+
 typedef enum {
 	VERBOSE = 0,
 	SUCCINCT
@@ -27,6 +34,39 @@ typedef enum {
 	PATIENT_ERECDAT
 } Patient_err;
 
+typedef struct {
+	Patient* patient;
+	struct tm exit_date;
+} Patient_exit;
+
+/* Snapshot of a country's patients, in the byte order of the machine that wrote it.
+ * The header is followed by the names of the record files the patients came from,
+ * one column per patient field and the string table. Strings are stored as offsets
+ * into the table, where repeated ones (viruses, names) are stored once. Dates are
+ * packed as yyyymmdd, -1 when undefined. */
+typedef struct {
+	char magic[8];
+	uint32_t country;
+	uint32_t npatients;
+	uint32_t nfiles;
+	uint32_t reserved;
+	uint64_t strtab_size;
+} Snapshot_header;
+
+enum { COL_ID, COL_FNAME, COL_LNAME, COL_VIRUS, COL_AGE, COL_ENTRY, COL_EXIT, COLS_NUM };
+
+typedef struct {
+	void*  addr;
+	size_t len;
+} Snapshot_map;
+
+struct strtab {
+	char*  buf;
+	size_t size;
+	size_t capacity;
+	Hashtable* index;   // String -> offset +1
+};
+
 static Patient* patient_init(const char* id, const char* fname, const char* lname,
                              const char* virus, const char* country, const char* age,
                              const char* entry_date, const char* exit_date);
@@ -34,9 +74,11 @@ static inline Patient* dummy_patient_init(const char* entry_date, const char* ex
 static void patient_free(Patient* p);
 static void patient_free_generic(void* p);
 static int  patient_set_exit(Patient* p, char* exit_date);
+static int  patient_check_exit(Patient* p, char* exit_date, struct tm* exit_tm);
 static void patient_printerr(Patient_err_opt opt, Patient_err err, ...);
 
 static void patientDB_hashhash_insert(Hashtable* ht, Patient* p, const char* country);
+static void patientDB_id_insert(Hashtable* ht, Patient* p);
 static void patientDB_hashtree_insert(Hashtable* ht, Patient* p, const char* key);
 
 static int  patient_date_comp_generic(const void* p1, const void* p2);
@@ -50,7 +92,10 @@ static struct vir_freq* patientDB_vir_freq(PatientDB* db, const char* country,
                                            const char* virus, const char* start_date,
                                            const char* end_date);
 
-static int vfv_comp_desc(const void* v1, const void* v2);
+static uint32_t strtab_intern(struct strtab* st, const char* str);
+static int32_t  date_pack(const struct tm* date);
+static struct tm date_unpack(int32_t packed);
+static void snapshot_map_free(void* map);
 
 
 /*
@@ -172,6 +217,8 @@ static Patient* patient_init(const char* id, const char* fname, const char* lnam
 	p->age     = ageval;
 	p->entry_date = entry_tm;
 	p->exit_date  = exit_tm;
+	p->borrowed   = false;
+	p->id_next    = NULL;
 
 	return p;
 }
@@ -184,7 +231,9 @@ static inline Patient* dummy_patient_init(const char* entry_date, const char* ex
 
 static void patient_free(Patient* p)
 {
-	if (p) {
+	if (p && p->borrowed)
+		free(p);
+	else if (p) {
 		free(p->id);
 		free(p->fname);
 		free(p->lname);
@@ -203,10 +252,7 @@ static int patient_set_exit(Patient* p, char* exit_date)
 {
 	struct tm exit_tm;
 
-	if (date_init(exit_date, &exit_tm))
-		return 0;
-
-	if (date_comp(&exit_tm, &p->entry_date) >= 0) {
+	if (patient_check_exit(p, exit_date, &exit_tm)) {
 		p->exit_date = exit_tm;
 		return 1;
 	}
@@ -214,14 +260,24 @@ static int patient_set_exit(Patient* p, char* exit_date)
 	return 0;
 }
 
-void patient_print(Patient* p, char** pstr)
+/* Validate an exit date without touching the patient */
+static int patient_check_exit(Patient* p, char* exit_date, struct tm* exit_tm)
+{
+	if (date_init(exit_date, exit_tm))
+		return 0;
+
+	return date_comp(exit_tm, &p->entry_date) >= 0;
+}
+
+/* Append the patient's record line to sb */
+void patient_print(Patient* p, Strbuf* sb)
 {
 	char date[2][DATE_BUFSIZE];
 
 	date_tostring(&p->entry_date, date[0]);
 	date_tostring(&p->exit_date,  date[1]);
 
-	xsprintf(pstr, "%s %s %s %s %d %s %s\n",
+	strbuf_appendf(sb, "%s %s %s %s %d %s %s\n",
 	         p->id, p->fname, p->lname, p->virus, p->age, date[0], date[1]);
 }
 
@@ -267,10 +323,19 @@ static void patient_printerr(Patient_err_opt opt, Patient_err err, ...)
 	}
 }
 
-List* patient_parse_file(const char* file, PatientDB* db)
+/* Parse a record file into delta. Patients of the base are looked up but never
+ * modified: their exits are recorded in the delta. With PARSE_EXITS_ONLY only the
+ * exits of known patients are applied and everything else is silently skipped;
+ * PARSE_NO_INVID silences exits of unknown patients.
+ * Return value:
+ * The patients admitted on the file's date
+ * */
+List* patient_parse_file(const char* file, PatientDB_delta* delta, int flags)
 {
 	FILE* fp;
 	Patient* patient;
+	Patient_exit* pexit;
+	struct tm exit_tm;
 	char*  line = NULL;
 	size_t line_size = 0;
 	char* country;
@@ -287,10 +352,14 @@ List* patient_parse_file(const char* file, PatientDB* db)
 	country = basename(dirname(file_copy));
 
 	for (int i = 0; getline(&line, &line_size, fp) != -1; ++i) {
+		if ((flags & PARSE_EXITS_ONLY) && !strstr(line, "EXIT"))
+			continue;
+
 		Vector* field = tokenize(line, " \t\n");
 
 		if (field->size < 6) {
-			patient_printerr(ERROPT, PATIENT_ELINE, line);
+			if (!(flags & PARSE_EXITS_ONLY))
+				patient_printerr(ERROPT, PATIENT_ELINE, line);
 			vector_free(field, free);
 			continue;
 		}
@@ -302,7 +371,12 @@ List* patient_parse_file(const char* file, PatientDB* db)
 		char* const virus = vector_get(field, 4);
 		char* const age   = vector_get(field, 5);
 
-		if ((patient = patientDB_get(db, country, id))) {
+		if ((flags & PARSE_EXITS_ONLY) && strcmp(act, "EXIT")) {
+			vector_free(field, free);
+			continue;
+		}
+
+		if ((patient = patientDB_get(delta->db, country, id))) {
 			if (!strcmp(act, "EXIT")) {
 				if (!patient_set_exit(patient, date))
 					patient_printerr(ERROPT, PATIENT_EEXIT, id);
@@ -310,14 +384,30 @@ List* patient_parse_file(const char* file, PatientDB* db)
 			else
 				patient_printerr(ERROPT, PATIENT_EDUPID, id);
 		}
+		else if ((patient = patientDB_get(delta->base, country, id))) {
+			if (!strcmp(act, "EXIT")) {
+				if (patient_check_exit(patient, date, &exit_tm)) {
+					pexit = xmalloc(sizeof(*pexit));
+					pexit->patient   = patient;
+					pexit->exit_date = exit_tm;
+					vector_append(delta->exits, pexit);
+				}
+				else
+					patient_printerr(ERROPT, PATIENT_EEXIT, id);
+			}
+			else
+				patient_printerr(ERROPT, PATIENT_EDUPID, id);
+		}
 		else {
-			if (!strcmp(act, "EXIT"))
-				patient_printerr(ERROPT, PATIENT_EINVID, id);
+			if (!strcmp(act, "EXIT")) {
+				if (!(flags & (PARSE_EXITS_ONLY | PARSE_NO_INVID)))
+					patient_printerr(ERROPT, PATIENT_EINVID, id);
+			}
 			else {
 				patient = patient_init(id, fname, lname, virus, country, age, date,
 				                       DATESTR_UNDEF);
 				if (patient)
-					patientDB_insert(db, patient);
+					patientDB_insert(delta->db, patient);
 				else
 					patient_printerr(ERROPT, PATIENT_ERECDAT, line);
 			}
@@ -326,7 +416,10 @@ List* patient_parse_file(const char* file, PatientDB* db)
 		vector_free(field, free);
 	}
 
-	List* patients_added = patientDB_getbydate(db, country, date);
+	List* patients_added = NULL;
+
+	if (!(flags & PARSE_EXITS_ONLY))
+		patients_added = patientDB_getbydate(delta->db, country, date);
 
 	free(line);
 	free(file_copy);
@@ -339,9 +432,11 @@ PatientDB* patientDB_init(void)
 {
 	PatientDB* db = xmalloc(sizeof(*db));
 
+	db->ids     = hashtable_init(1024, hashtable_min_bucket_size());
 	db->cntrid  = hashtable_init(100, hashtable_min_bucket_size());
 	db->cntree  = hashtable_init(100, hashtable_min_bucket_size());
 	db->virtree = hashtable_init(100, hashtable_min_bucket_size());
+	db->snapshots = vector_init();
 
 	return db;
 }
@@ -359,11 +454,68 @@ void patientDB_free(PatientDB* db)
 	while ((keyval = hashtable_next(db->virtree)))
 		tree_free(keyval->val, NULL);
 
+	hashtable_free(db->ids,     NULL);
 	hashtable_free(db->cntrid,  NULL);
 	hashtable_free(db->cntree,  NULL);
 	hashtable_free(db->virtree, NULL);
 
+	// The patients borrowing from the mappings are gone
+	vector_free(db->snapshots, snapshot_map_free);
+
+	free(db);
+}
+
+PatientDB_delta* patientDB_delta_init(PatientDB* base)
+{
+	PatientDB_delta* delta = xmalloc(sizeof(*delta));
+
+	delta->base  = base;
+	delta->db    = patientDB_init();
+	delta->exits = vector_init();
+
+	return delta;
+}
+
+/* Move the delta's patients into its base, apply the recorded exits and free the
+ * delta. The caller holds the base exclusively for the duration */
+void patientDB_merge(PatientDB_delta* delta)
+{
+	PatientDB* db = delta->db;
+	Patient_exit* pexit;
+	Keyval* keyval;
+	Keyval* kv;
+	int i;
+
+	while ((keyval = hashtable_next(db->cntrid))) {
+		while ((kv = hashtable_next(keyval->val)))
+			patientDB_insert(delta->base, kv->val);
+
+		hashtable_free(keyval->val, NULL);
+	}
+
+	for (i = 0; i < delta->exits->size; ++i) {
+		pexit = delta->exits->entry[i];
+		pexit->patient->exit_date = pexit->exit_date;
+	}
+
+	for (i = 0; i < db->snapshots->size; ++i)
+		vector_append(delta->base->snapshots, db->snapshots->entry[i]);
+	vector_free(db->snapshots, NULL);
+
+	while ((keyval = hashtable_next(db->cntree)))
+		tree_free(keyval->val, NULL);
+
+	while ((keyval = hashtable_next(db->virtree)))
+		tree_free(keyval->val, NULL);
+
+	hashtable_free(db->ids,     NULL);
+	hashtable_free(db->cntrid,  NULL);
+	hashtable_free(db->cntree,  NULL);
+	hashtable_free(db->virtree, NULL);
 	free(db);
+
+	vector_free(delta->exits, free);
+	free(delta);
 }
 
 static void patientDB_hashhash_insert(Hashtable* ht, Patient* p, const char* country)
@@ -394,8 +546,24 @@ static void patientDB_hashtree_insert(Hashtable* ht, Patient* p, const char* key
 	}
 }
 
+/* The first patient with an id stays in the table and the others are linked after it */
+static void patientDB_id_insert(Hashtable* ht, Patient* p)
+{
+	Patient* first;
+
+	if ((first = hashtable_find(ht, p->id))) {
+		p->id_next = first->id_next;
+		first->id_next = p;
+	}
+	else {
+		p->id_next = NULL;
+		hashtable_insert(ht, p->id, p);
+	}
+}
+
 void patientDB_insert(PatientDB* db, Patient* p)
 {
+	patientDB_id_insert(db->ids, p);
 	patientDB_hashhash_insert(db->cntrid,  p, p->country);
 	patientDB_hashtree_insert(db->cntree,  p, p->country);
 	patientDB_hashtree_insert(db->virtree, p, p->virus);
@@ -412,6 +580,14 @@ Patient* patientDB_get(PatientDB* db, const char* country, const char* id)
 	return NULL;
 }
 
+/* Return value:
+ * The first patient with the id in any country, followed by the rest through id_next
+ * */
+Patient* patientDB_getbyid(PatientDB* db, const char* id)
+{
+	return hashtable_find(db->ids, id);
+}
+
 Hashtable* patientDB_getbycountry(PatientDB* db, const char* country)
 {
 	return hashtable_find(db->cntrid, country);
@@ -541,64 +717,27 @@ end:
 	return cb_data;
 }
 
-static int vfv_comp_desc(const void* v1, const void* v2)
-{
-	int i1 = **(int**)v1;
-	int i2 = **(int**)v2;
-
-	return i2 -i1;
-}
-
-char* patientDB_topkAgeRanges(PatientDB* db, int k, const char* country,
-                              const char* virus, const char* start_date,
-                              const char* end_date)
+/* Count the patients of each age range admitted for virus within the date range.
+ * Return value:
+ * 0 on success, -1 if the country is unknown or a date is invalid
+ * */
+int patientDB_ageRanges(PatientDB* db, const char* country, const char* virus,
+                        const char* start_date, const char* end_date,
+                        int count[STATS_AGE_RANGES])
 {
 	struct vir_freq* freq;
-	Vector* vfv;
 
 	freq = patientDB_vir_freq(db, country, virus, start_date, end_date);
-	if (!freq) return NULL;
-
-	vfv = vector_init();
-	vector_append(vfv, &freq->upto20);
-	vector_append(vfv, &freq->upto40);
-	vector_append(vfv, &freq->upto60);
-	vector_append(vfv, &freq->plus60);
-	vector_sort(vfv, vfv_comp_desc);
-
-	const int age_categories = (k <= vfv->size) ? k : vfv->size;
-	char* stats_total;
-	char* stats[age_categories];
-	char* format;
-	int*  catval;
-	int   freq_sum;
-
-	freq_sum = freq->upto20 +freq->upto40 +freq->upto60 +freq->plus60;
-
-	for (int i = 0; i < age_categories; ++i) {
-		catval = vector_get(vfv, i);
-
-		if (catval == &freq->upto20)
-			format = "0-20: %.0f%%\n";
-		else if (catval == &freq->upto40)
-			format = "0-40: %.0f%%\n";
-		else if (catval == &freq->upto60)
-			format = "0-60: %.0f%%\n";
-		else
-			format =  "60+: %.0f%%\n";
-
-		xsprintf(&stats[i], format, freq_sum ? (*catval/(float)freq_sum)*100 : 0);
-	}
-
-	stats_total = string_arr_flatten(stats, NULL, age_categories);
+	if (!freq) return -1;
 
-	for (int i = 0; i < age_categories; ++i)
-		free(stats[i]);
+	count[0] = freq->upto20;
+	count[1] = freq->upto40;
+	count[2] = freq->upto60;
+	count[3] = freq->plus60;
 
 	free(freq);
-	vector_free(vfv, NULL);
 
-	return stats_total;
+	return 0;
 }
 
 struct adm_cb_data {
@@ -619,14 +758,18 @@ static int adm_cb(List* patients, void* cb_data)
 	return 0;
 }
 
-char* patientDB_admissions(PatientDB* db, const char* country, const char* virus,
-                           const char* start_date, const char* end_date)
+/* Append the "country admissions" line to sb.
+ * Return value:
+ * 0 on success, -1 if the country is unknown or a date is invalid
+ * */
+int patientDB_admissions(PatientDB* db, const char* country, const char* virus,
+                         const char* start_date, const char* end_date, Strbuf* sb)
 {
 	struct adm_cb_data cb_data = { virus, 0 };
 	Patient* dummy1 = NULL;
 	Patient* dummy2 = NULL;
 	Tree* tree;
-	char* res = NULL;
+	int ret = -1;
 
 	if ((tree = hashtable_find(db->cntree, country)) == NULL)
 		goto end;
@@ -639,13 +782,14 @@ char* patientDB_admissions(PatientDB* db, const char* country, const char* virus
 
 	tree_traverse_range(tree, TREE_PREORDER, &cb_data, adm_cb, dummy1, dummy2);
 
-	xsprintf(&res, "%s %d\n", country, cb_data.n);
+	strbuf_appendf(sb, "%s %d\n", country, cb_data.n);
+	ret = 0;
 
 end:
 	patient_free(dummy1);
 	patient_free(dummy2);
 
-	return res;
+	return ret;
 }
 
 struct dis_cb_data {
@@ -673,28 +817,286 @@ static int dis_cb(List* patients, void* cb_data)
 	return 0;
 }
 
-char* patientDB_discharges(PatientDB* db, const char* country, const char* virus,
-                           const char* start_date, const char* end_date)
+/* Same as patientDB_admissions() for the patients' exits */
+int patientDB_discharges(PatientDB* db, const char* country, const char* virus,
+                         const char* start_date, const char* end_date, Strbuf* sb)
 {
 	struct tm start_tm;
 	struct tm end_tm;
 	Tree* tree;
-	char* res;
 
 	if ((tree = hashtable_find(db->cntree, country)) == NULL)
-		return NULL;
+		return -1;
 
 	if (date_init(start_date, &start_tm))
-		return NULL;
+		return -1;
 
 	if (date_init(end_date, &end_tm))
-		return NULL;
+		return -1;
 
 	struct dis_cb_data cb_data = { start_tm, end_tm, virus, 0 };
 
 	tree_traverse(tree, TREE_PREORDER, &cb_data, dis_cb);
 
-	xsprintf(&res, "%s %d\n", country, cb_data.n);
+	strbuf_appendf(sb, "%s %d\n", country, cb_data.n);
+
+	return 0;
+}
+
+/* Call cb with the patients of every entry date of a country, in date order */
+int patientDB_foreach_date(PatientDB* db, const char* country, void* cb_data,
+                           int (*cb)(List* patients, void* cb_data))
+{
+	Tree* tree = hashtable_find(db->cntree, country);
+
+	if (!tree)
+		return 0;
+
+	return tree_traverse(tree, TREE_INORDER, cb_data, cb);
+}
+
+/* Write a snapshot of a country's patients along with the names of the record files
+ * they were parsed from. The snapshot is written next to path and renamed over it, so
+ * that a reader never sees a partial one.
+ * Return value:
+ * 0 on success, -1 on failure
+ * */
+int patientDB_snapshot_save(PatientDB* db, const char* country, Vector* files,
+                            const char* path)
+{
+	Snapshot_header header = {0};
+	struct strtab st = {0};
+	Hashtable* patients;
+	Keyval* keyval;
+	Patient* p;
+	uint32_t* col[COLS_NUM];
+	uint32_t* fcol;
+	uint32_t  n = 0;
+	char* tmppath;
+	FILE* fp;
+	int ret = 0;
+	int i;
+
+	patients = patientDB_getbycountry(db, country);
+	header.npatients = patients ? hashtable_nentries(patients) : 0;
+	header.nfiles    = files->size;
+
+	st.index = hashtable_init(1000, hashtable_min_bucket_size());
+	header.country = strtab_intern(&st, country);
+
+	fcol = xmalloc((files->size +1)*sizeof(*fcol));
+	for (i = 0; i < files->size; ++i)
+		fcol[i] = strtab_intern(&st, files->entry[i]);
+
+	for (i = 0; i < COLS_NUM; ++i)
+		col[i] = xmalloc((header.npatients +1)*sizeof(*col[i]));
+
+	while (patients && (keyval = hashtable_next(patients))) {
+		p = keyval->val;
+
+		col[COL_ID   ][n] = strtab_intern(&st, p->id);
+		col[COL_FNAME][n] = strtab_intern(&st, p->fname);
+		col[COL_LNAME][n] = strtab_intern(&st, p->lname);
+		col[COL_VIRUS][n] = strtab_intern(&st, p->virus);
+		col[COL_AGE  ][n] = p->age;
+		col[COL_ENTRY][n] = date_pack(&p->entry_date);
+		col[COL_EXIT ][n] = date_pack(&p->exit_date);
+		n++;
+	}
+
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.strtab_size = st.size;
+
+	xsprintf(&tmppath, "%s.tmp", path);
+
+	if (!(fp = fopen(tmppath, "wb"))) {
+		perror("fopen()");
+		ret = -1;
+		goto end;
+	}
+
+	fwrite(&header, sizeof(header), 1, fp);
+	fwrite(fcol, sizeof(*fcol), header.nfiles, fp);
+	for (i = 0; i < COLS_NUM; ++i)
+		fwrite(col[i], sizeof(*col[i]), header.npatients, fp);
+	fwrite(st.buf, 1, st.size, fp);
+
+	if (fflush(fp) || fsync(fileno(fp)) || ferror(fp)) {
+		perror("snapshot write");
+		ret = -1;
+	}
+	fclose(fp);
+
+	if (ret == 0 && rename(tmppath, path)) {
+		perror("rename()");
+		ret = -1;
+	}
+	if (ret)
+		unlink(tmppath);
+
+end:
+	for (i = 0; i < COLS_NUM; ++i)
+		free(col[i]);
+	free(fcol);
+	free(tmppath);
+	free(st.buf);
+	hashtable_free(st.index, NULL);
+
+	return ret;
+}
+
+/* Map a country's snapshot and insert its patients in db. Their strings are not
+ * copied but point into the mapping, which db keeps for as long as it lives.
+ * Return value:
+ * The names of the record files the snapshot covers, or NULL if there is no valid
+ * snapshot at path
+ * */
+Vector* patientDB_snapshot_load(PatientDB* db, const char* country, const char* path)
+{
+	Snapshot_header header;
+	Snapshot_map* map;
+	struct stat st;
+	const uint32_t* fcol;
+	const uint32_t* col[COLS_NUM];
+	const char* strtab;
+	Vector*  files;
+	Patient* p;
+	size_t expected;
+	void* addr;
+	uint32_t i;
+	int j;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return NULL;
+
+	if (fstat(fd, &st) || st.st_size < sizeof(header)) {
+		close(fd);
+		return NULL;
+	}
+
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED)
+		return NULL;
+
+	memcpy(&header, addr, sizeof(header));
+
+	expected = sizeof(header) +(size_t)header.nfiles*sizeof(*fcol) +
+	           (size_t)header.npatients*COLS_NUM*sizeof(*fcol) +header.strtab_size;
+
+	fcol   = (const uint32_t*)((char*)addr +sizeof(header));
+	strtab = (const char*)(fcol +header.nfiles +(size_t)header.npatients*COLS_NUM);
+
+	// Strings must lie within the table and be terminated
+	if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) ||
+	    expected != st.st_size || !header.strtab_size ||
+	    strtab[header.strtab_size -1] != '\0' ||
+	    header.country >= header.strtab_size ||
+	    strcmp(strtab +header.country, country)) {
+		munmap(addr, st.st_size);
+		return NULL;
+	}
+
+	for (j = 0; j < COLS_NUM; ++j)
+		col[j] = fcol +header.nfiles +(size_t)j*header.npatients;
+
+	for (i = 0; i < header.nfiles; ++i)
+		if (fcol[i] >= header.strtab_size)
+			goto invalid;
+
+	for (i = 0; i < header.npatients; ++i)
+		if (col[COL_ID   ][i] >= header.strtab_size ||
+		    col[COL_FNAME][i] >= header.strtab_size ||
+		    col[COL_LNAME][i] >= header.strtab_size ||
+		    col[COL_VIRUS][i] >= header.strtab_size)
+			goto invalid;
+
+	for (i = 0; i < header.npatients; ++i) {
+		p = xmalloc(sizeof(*p));
+
+		p->id      = (char*)strtab +col[COL_ID   ][i];
+		p->fname   = (char*)strtab +col[COL_FNAME][i];
+		p->lname   = (char*)strtab +col[COL_LNAME][i];
+		p->virus   = (char*)strtab +col[COL_VIRUS][i];
+		p->country = (char*)strtab +header.country;
+		p->age     = col[COL_AGE][i];
+		p->entry_date = date_unpack(col[COL_ENTRY][i]);
+		p->exit_date  = date_unpack(col[COL_EXIT ][i]);
+		p->borrowed   = true;
+		p->id_next    = NULL;
+
+		patientDB_insert(db, p);
+	}
+
+	map = xmalloc(sizeof(*map));
+	map->addr = addr;
+	map->len  = st.st_size;
+	vector_append(db->snapshots, map);
+
+	files = vector_init();
+	for (i = 0; i < header.nfiles; ++i)
+		vector_append(files, xstrdup(strtab +fcol[i]));
+
+	return files;
+
+invalid:
+	munmap(addr, st.st_size);
+	return NULL;
+}
+
+static void snapshot_map_free(void* map)
+{
+	Snapshot_map* m = map;
+
+	munmap(m->addr, m->len);
+	free(m);
+}
+
+static uint32_t strtab_intern(struct strtab* st, const char* str)
+{
+	size_t len = strlen(str) +1;
+	uintptr_t found;
+	uint32_t off;
+
+	// The index ignores case. Only an exact match is shared
+	found = (uintptr_t)hashtable_find(st->index, str);
+	if (found && !strcmp(st->buf +found -1, str))
+		return found -1;
+
+	if (st->size +len > st->capacity) {
+		st->capacity = (st->capacity +len)*2;
+		st->buf = xrealloc(st->buf, st->capacity);
+	}
+
+	off = st->size;
+	memcpy(st->buf +off, str, len);
+	st->size += len;
+
+	if (!found)
+		hashtable_insert(st->index, str, (void*)((uintptr_t)off +1));
+
+	return off;
+}
+
+static int32_t date_pack(const struct tm* date)
+{
+	if (DATE_ISUNDEF(*date))
+		return -1;
+
+	return (date->tm_year +1900)*10000 +(date->tm_mon +1)*100 +date->tm_mday;
+}
+
+static struct tm date_unpack(int32_t packed)
+{
+	struct tm date = {0};
+
+	if (packed == -1)
+		return DATE_UNDEF_INIT;
+
+	date.tm_year = packed/10000 -1900;
+	date.tm_mon  = packed/100 %100 -1;
+	date.tm_mday = packed %100;
 
-	return res;
+	return date;
 }
@@ -2,13 +2,20 @@
 #define PATIENT_H
 
 #include <time.h>
+#include <stdbool.h>
 #include "vector.h"
 #include "hashtable.h"
 #include "list.h"
+#include "strbuf.h"
+#include "stats.h"
 
 #define DATE_BUFSIZE 11
 
-typedef struct {
+#define PARSE_DEFAULT    0
+#define PARSE_EXITS_ONLY 1   // Apply the exits of known patients only
+#define PARSE_NO_INVID   2   // Exits of unknown patients are not errors
+
+typedef struct Patient {
 	char* id;
 	char* fname;
 	char* lname;
@@ -17,38 +24,61 @@ typedef struct {
 	int   age;
 	struct tm entry_date;
 	struct tm exit_date;
+	bool borrowed;    // The strings point into a snapshot mapping
+	struct Patient* id_next;  // Next patient with the same id, in another country
 } Patient;
 
 typedef struct {
+	Hashtable* ids;      // Id -> first patient with it, across the countries
 	Hashtable* cntrid;
 	Hashtable* cntree;
 	Hashtable* virtree;
+	Vector* snapshots;   // Mappings of the snapshots the patients were loaded from
 } PatientDB;
 
+/* Changes parsed from record files while base keeps being queried. The base is only
+ * read until the delta is merged into it in one step. */
+typedef struct {
+	PatientDB* base;
+	PatientDB* db;     // Patients admitted by the parsed files
+	Vector* exits;     // Exits of patients already in the base
+} PatientDB_delta;
+
 int date_init(const char* datestr, struct tm* date);
 int date_comp(const struct tm* date1, const struct tm* date2);
 char* date_tostring(struct tm* date, char* buf);
 
-List* patient_parse_file(const char* file, PatientDB* db);
-void  patient_print(Patient* p, char** pstr);
+List* patient_parse_file(const char* file, PatientDB_delta* delta, int flags);
+void  patient_print(Patient* p, Strbuf* sb);
 
 PatientDB* patientDB_init(void);
 void patientDB_free(PatientDB* db);
 void patientDB_insert(PatientDB* db, Patient* p);
 Patient* patientDB_get(PatientDB* db, const char* country, const char* id);
+Patient* patientDB_getbyid(PatientDB* db, const char* id);
 Hashtable* patientDB_getbycountry(PatientDB* db, const char* country);
 List* patientDB_getbydate(PatientDB* db, const char* country, const char* date);
 
+PatientDB_delta* patientDB_delta_init(PatientDB* base);
+void patientDB_merge(PatientDB_delta* delta);
+
+int patientDB_foreach_date(PatientDB* db, const char* country, void* cb_data,
+                           int (*cb)(List* patients, void* cb_data));
+
+int patientDB_snapshot_save(PatientDB* db, const char* country, Vector* files,
+                            const char* path);
+Vector* patientDB_snapshot_load(PatientDB* db, const char* country, const char* path);
+
 int patientDB_diseaseFreq(PatientDB* db, const char* virus, const char* start_date,
                           const char* end_date, const char* country);
 
-char* patientDB_topkAgeRanges(PatientDB* db, int k, const char* country,
-                              const char* virus, const char* start_date,
-                              const char* end_date);
+int patientDB_ageRanges(PatientDB* db, const char* country, const char* virus,
+                        const char* start_date, const char* end_date,
+                        int count[STATS_AGE_RANGES]);
 
-char* patientDB_admissions(PatientDB* db, const char* country, const char* virus,
-                           const char* start_date, const char* end_date);
+int patientDB_admissions(PatientDB* db, const char* country, const char* virus,
+                         const char* start_date, const char* end_date, Strbuf* sb);
 
-char* patientDB_discharges(PatientDB* db, const char* country, const char* virus,
-                           const char* start_date, const char* end_date);
+int patientDB_discharges(PatientDB* db, const char* country, const char* virus,
+                         const char* start_date, const char* end_date, Strbuf* sb);
 #endif
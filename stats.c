@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "tools.h"
+#include "msg.h"
+#include "stats.h"
+
+static uint16_t stats_name_id(Stats* st, const char* name);
+
+Stats* stats_init(void)
+{
+	Stats* st = xcalloc(1, sizeof(*st));
+
+	st->ids   = hashtable_init(20, hashtable_min_bucket_size());
+	st->names = vector_init();
+	st->fd    = -1;
+
+	return st;
+}
+
+void stats_free(Stats* st)
+{
+	if (st) {
+		hashtable_free(st->ids, NULL);
+		vector_free(st->names, free);
+		free(st->records);
+		free(st);
+	}
+}
+
+/* Empty the batch, keeping the memory it has grown to */
+void stats_clear(Stats* st)
+{
+	hashtable_free(st->ids, NULL);
+	vector_free(st->names, free);
+
+	st->ids   = hashtable_init(20, hashtable_min_bucket_size());
+	st->names = vector_init();
+	st->nrecords   = 0;
+	st->names_size = 0;
+}
+
+/* Send the batch to fd as soon as it holds STATS_BATCH_RECORDS records, so that a
+ * large load goes out in frames of bounded size as it is parsed. Whatever is left is
+ * still sent by stats_send() */
+void stats_stream(Stats* st, int fd)
+{
+	st->fd = fd;
+}
+
+static uint16_t stats_name_id(Stats* st, const char* name)
+{
+	uintptr_t id;
+
+	if ((id = (uintptr_t)hashtable_find(st->ids, name)))
+		return id -1;
+
+	if (st->names->size > UINT16_MAX)
+		err_exit("Too many names in a statistics batch");
+
+	vector_append(st->names, xstrdup(name));
+	hashtable_insert(st->ids, name, (void*)(uintptr_t)st->names->size);
+	st->names_size += strlen(name) +1;
+
+	return st->names->size -1;
+}
+
+void stats_add(Stats* st, const char* country, const char* virus, int date,
+               const int count[STATS_AGE_RANGES])
+{
+	Stats_record* rec;
+	int i;
+
+	if (st->nrecords == st->capacity) {
+		st->capacity = st->capacity ? st->capacity*2 : 64;
+		st->records  = xrealloc(st->records, st->capacity*sizeof(*st->records));
+	}
+
+	rec = &st->records[st->nrecords++];
+	rec->date    = date;
+	rec->country = stats_name_id(st, country);
+	rec->virus   = stats_name_id(st, virus);
+	for (i = 0; i < STATS_AGE_RANGES; ++i)
+		rec->count[i] = count[i];
+
+	if (st->fd != -1 && st->nrecords >= STATS_BATCH_RECORDS)
+		stats_send(st, st->fd);
+}
+
+/* Send the batch as a single frame and empty it. An empty batch is not sent.
+ * Return value:
+ * Same as write_msg()
+ * */
+int stats_send(Stats* st, int fd)
+{
+	Stats_header header;
+	size_t size;
+	char* buf;
+	char* p;
+	int ret;
+	int i;
+
+	if (!st->nrecords)
+		return 0;
+
+	memcpy(header.magic, STATS_MAGIC, sizeof(header.magic));
+	header.nnames     = st->names->size;
+	header.names_size = st->names_size;
+	header.nrecords   = st->nrecords;
+
+	size = sizeof(header) +st->names_size +st->nrecords*sizeof(*st->records);
+	buf  = xmalloc(size);
+
+	memcpy(buf, &header, sizeof(header));
+	p = buf +sizeof(header);
+
+	for (i = 0; i < st->names->size; ++i) {
+		strcpy(p, st->names->entry[i]);
+		p += strlen(p) +1;
+	}
+
+	memcpy(p, st->records, st->nrecords*sizeof(*st->records));
+
+	ret = write_msg_buf(fd, buf, size);
+
+	free(buf);
+	stats_clear(st);
+
+	return ret;
+}
+
+bool stats_is_batch(const char* msg, size_t len)
+{
+	return len >= sizeof(Stats_header) && !memcmp(msg, STATS_MAGIC, 4);
+}
+
+/* Call cb for every record of a batch.
+ * Return value:
+ * 0 on success, -1 if the batch is malformed
+ * */
+int stats_parse(const char* msg, size_t len, void* cb_data, Stats_cb cb)
+{
+	Stats_header header;
+	Stats_record rec;
+	const char** names;
+	const char* p;
+	const char* end = msg +len;
+	int count[STATS_AGE_RANGES];
+	int ret = -1;
+	uint32_t i, j;
+
+	if (!stats_is_batch(msg, len))
+		return -1;
+
+	memcpy(&header, msg, sizeof(header));
+	p = msg +sizeof(header);
+
+	if (header.names_size > (size_t)(end -p) ||
+	    header.nrecords > (end -p -header.names_size)/sizeof(rec) ||
+	    header.nnames > header.names_size ||
+	    (header.names_size && p[header.names_size -1] != '\0'))
+		return -1;
+
+	// Sized off the wire, so not on the stack
+	names = xmalloc((header.nnames ? header.nnames : 1) * sizeof(*names));
+
+	// The names region ends in a NUL, so every name does
+	for (i = 0; i < header.nnames; ++i) {
+		if (p >= msg +sizeof(header) +header.names_size)
+			goto end;
+		names[i] = p;
+		p += strlen(p) +1;
+	}
+	p = msg +sizeof(header) +header.names_size;
+
+	for (i = 0; i < header.nrecords; ++i, p += sizeof(rec)) {
+		memcpy(&rec, p, sizeof(rec));
+		if (rec.country >= header.nnames || rec.virus >= header.nnames)
+			goto end;
+
+		for (j = 0; j < STATS_AGE_RANGES; ++j)
+			count[j] = rec.count[j];
+
+		cb(names[rec.country], names[rec.virus], rec.date, count, cb_data);
+	}
+	ret = 0;
+
+end:
+	free(names);
+
+	return ret;
+}
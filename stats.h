@@ -0,0 +1,55 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "hashtable.h"
+#include "vector.h"
+
+#define STATS_AGE_RANGES 4   // Patient age ranges, for every per-range count
+#define STATS_MAGIC "STB1"
+#define STATS_BATCH_RECORDS 4096   // Records past which a streamed batch is sent
+
+/* A batch of statistics as sent by the workers: the header, the names the records
+ * refer to by index (NUL-terminated, back to back), then the records */
+typedef struct {
+	char     magic[4];
+	uint32_t nnames;
+	uint32_t names_size;   // Bytes taken up by the names
+	uint32_t nrecords;
+} Stats_header;
+
+/* The admissions for a virus in a country on a date */
+typedef struct {
+	int32_t  date;         // yyyymmdd
+	uint16_t country;      // Name indices
+	uint16_t virus;
+	uint32_t count[STATS_AGE_RANGES];
+} Stats_record;
+
+/* A batch under construction */
+typedef struct {
+	Hashtable* ids;        // Name -> index +1
+	Vector* names;
+	Stats_record* records;
+	size_t nrecords;
+	size_t capacity;
+	size_t names_size;
+	int fd;                // Where full batches are streamed to, -1 to hold them
+} Stats;
+
+typedef void (*Stats_cb)(const char* country, const char* virus, int date,
+                         const int count[STATS_AGE_RANGES], void* cb_data);
+
+Stats* stats_init(void);
+void   stats_free(Stats* st);
+void   stats_clear(Stats* st);
+void   stats_stream(Stats* st, int fd);
+void   stats_add(Stats* st, const char* country, const char* virus, int date,
+                 const int count[STATS_AGE_RANGES]);
+int    stats_send(Stats* st, int fd);
+bool   stats_is_batch(const char* msg, size_t len);
+int    stats_parse(const char* msg, size_t len, void* cb_data, Stats_cb cb);
+
+#endif
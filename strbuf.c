@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "tools.h"
+#include "strbuf.h"
+
+#define STRBUF_INITSIZE 64
+
+static void strbuf_reserve(Strbuf* sb, size_t n);
+
+Strbuf* strbuf_init(void)
+{
+	Strbuf* sb = xmalloc(sizeof(*sb));
+
+	sb->capacity = STRBUF_INITSIZE;
+	sb->buf = xmalloc(sb->capacity);
+	sb->buf[0] = '\0';
+	sb->len = 0;
+
+	return sb;
+}
+
+void strbuf_free(Strbuf* sb)
+{
+	if (sb) {
+		free(sb->buf);
+		free(sb);
+	}
+}
+
+/* Empty the buffer, keeping the memory it has grown to */
+void strbuf_clear(Strbuf* sb)
+{
+	sb->buf[0] = '\0';
+	sb->len = 0;
+}
+
+/* Make room for n more bytes and the terminating NUL */
+static void strbuf_reserve(Strbuf* sb, size_t n)
+{
+	if (sb->len +n +1 <= sb->capacity)
+		return;
+
+	while (sb->len +n +1 > sb->capacity)
+		sb->capacity *= 2;
+
+	sb->buf = xrealloc(sb->buf, sb->capacity);
+}
+
+void strbuf_append(Strbuf* sb, const char* str)
+{
+	strbuf_appendn(sb, str, strlen(str));
+}
+
+void strbuf_appendn(Strbuf* sb, const char* str, size_t n)
+{
+	strbuf_reserve(sb, n);
+
+	memcpy(sb->buf +sb->len, str, n);
+	sb->len += n;
+	sb->buf[sb->len] = '\0';
+}
+
+/* Append formatted output, like sprintf().
+ * Return value:
+ * The number of bytes appended
+ * */
+int strbuf_appendf(Strbuf* sb, const char* format, ...)
+{
+	va_list args;
+	int len;
+
+	va_start(args, format);
+	len = vsnprintf(sb->buf +sb->len, sb->capacity -sb->len, format, args);
+	va_end(args);
+
+	if (len < 0)
+		syserr_exit("vsnprintf()");
+
+	// Did not fit. Grow and print again
+	if (sb->len +len +1 > sb->capacity) {
+		strbuf_reserve(sb, len);
+
+		va_start(args, format);
+		vsnprintf(sb->buf +sb->len, sb->capacity -sb->len, format, args);
+		va_end(args);
+	}
+
+	sb->len += len;
+
+	return len;
+}
+
+/* Remove the first n bytes */
+void strbuf_drop(Strbuf* sb, size_t n)
+{
+	memmove(sb->buf, sb->buf +n, sb->len -n +1);
+	sb->len -= n;
+}
+
+/* Free the buffer, handing its string over to the caller */
+char* strbuf_steal(Strbuf* sb)
+{
+	char* str = sb->buf;
+
+	free(sb);
+
+	return str;
+}
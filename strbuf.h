@@ -0,0 +1,24 @@
+#ifndef STRBUF_H
+#define STRBUF_H
+
+#include <stddef.h>
+
+/* Growable string. Appending takes amortized constant time per byte, unlike xstrcat()
+ * which copies the whole string every time. buf is always NUL-terminated. */
+typedef struct {
+	char*  buf;
+	size_t len;
+	size_t capacity;
+} Strbuf;
+
+Strbuf* strbuf_init(void);
+void  strbuf_free(Strbuf* sb);
+void  strbuf_clear(Strbuf* sb);
+void  strbuf_append(Strbuf* sb, const char* str);
+void  strbuf_appendn(Strbuf* sb, const char* str, size_t n);
+int   strbuf_appendf(Strbuf* sb, const char* format, ...)
+      __attribute__((format(printf, 2, 3)));
+void  strbuf_drop(Strbuf* sb, size_t n);
+char* strbuf_steal(Strbuf* sb);
+
+#endif
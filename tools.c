@@ -27,6 +27,15 @@ void* xcalloc(size_t num, size_t size)
 	return ptr;
 }
 
+void* xrealloc(void* ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (!ptr)
+		abort();
+
+	return ptr;
+}
+
 void* memdup(const void* src, size_t n)
 {
 	char* dest = xmalloc(n);
@@ -173,6 +182,7 @@ Vector* tokenize(const char* str, const char* delim)
 	Vector* v;
 	char*  nstr;
 	char*  pch;
+	char*  saveptr;
 
 	v = vector_init();
 	if (!v)
@@ -180,10 +190,10 @@ Vector* tokenize(const char* str, const char* delim)
 
 	nstr = xstrdup(str);
 
-	pch = strtok(nstr, delim);
+	pch = strtok_r(nstr, delim, &saveptr);
 	while (pch) {
 		vector_append(v, xstrdup(pch));
-		pch = strtok(NULL, delim);
+		pch = strtok_r(NULL, delim, &saveptr);
 	}
 
 	free(nstr);
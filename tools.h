@@ -6,6 +6,7 @@
 
 void* xmalloc(size_t size);
 void* xcalloc(size_t num, size_t size);
+void* xrealloc(void* ptr, size_t size);
 void* memdup(const void* src, size_t n);
 char* xstrdup(const char* str);
 void  xstrcat(char** str1, const char* str2);
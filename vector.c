@@ -70,6 +70,14 @@ void* vector_get(Vector* v, int pos)
 	return v->entry[pos];
 }
 
+void* vector_pop(Vector* v)
+{
+	if (v->size == 0)
+		return NULL;
+
+	return v->entry[--v->size];
+}
+
 void vector_sort(Vector* v, int (*comp)(const void* p1, const void* p2))
 {
 	qsort(v->entry, v->size, sizeof(void*), comp);
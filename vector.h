@@ -12,6 +12,7 @@ void  vector_free(Vector* v, void (*free_entry)(void*));
 int   vector_append(Vector* v, void* entry);
 int   vector_find(Vector* v, void* entry, int (*comp)(const void* p1, const void* p2));
 void* vector_get(Vector* v, int pos);
+void* vector_pop(Vector* v);
 void  vector_sort(Vector* v, int (*comp)(const void* p1, const void* p2));
 
 int vector_strcmp(const void* v1, const void* v2);
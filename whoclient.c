@@ -2,49 +2,98 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
 #include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include "tools.h"
 #include "msg.h"
+#include "strbuf.h"
+#include "command.h"
+#include "list.h"
+#include "hist.h"
+
+#define PIPELINE_DEPTH 8   // Requests sent ahead of their replies, per connection
+#define BENCH_OUT_MAX (64u << 10)  // Benchmark: unsent bytes past which queries drop
 
 struct CLA {
 	char* query_filepath;
 	int nthreads;
 	char* srv_ip;
 	int srv_port;
+	int batch_size;   // Queries per request
+	int rate;         // Benchmark: queries per second, 0 to replay the query file
+	int duration;     // Benchmark: seconds to keep sending for
 };
 
-struct handler_data {
-	struct sockaddr_in srv_addr;
-	char* query;
+/* A connection to whoServer, over which a sender thread pipelines requests while a
+ * receiver thread prints the replies as they come, in order */
+struct conn_data {
+	int fd;
+	List* inflight;      // Requests sent and not yet answered, oldest first
+	bool  sent_all;      // No more requests are coming
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;
+	Hist* latency[LAST +1];  // Benchmark: by command, LAST for the rest. In us
+	long  last_reply;        // Benchmark: when the last reply came in
+	Strbuf* out;             // Benchmark: queries the socket has not taken yet
+	long  dropped;           // Benchmark: queries not sent for lack of room
+	bool  lost;              // Benchmark: the server has closed the connection
+};
+
+/* A benchmark query in flight */
+struct bench_req {
+	long sched;          // When it was due to be sent, in us
+	Command_val cmd;
 };
 
 void print_usage(char* progname);
 void parse_cla(int argc, char** argv);
-void* query_handler(void* query);
+char* read_request(FILE* query_file);
+char* next_request(void);
+void* conn_sender(void* data);
+void* conn_receiver(void* data);
+void  print_reply(Msg_reader* reader, const char* request);
+long  now_us(void);
+Vector*     bench_load(FILE* query_file);
+Command_val bench_command(const char* query);
+long  bench_dispatch(struct conn_data* data, Vector* mix, long start);
+void  bench_flush(struct conn_data* data, long until);
+void  bench_reply(struct conn_data* d, Msg_reader* reader, struct bench_req* req);
+void  bench_report(struct conn_data* data, long start, long sent);
 
 // Globals
 struct CLA g_cla;
 pthread_mutex_t mutex_print = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t  cond  = PTHREAD_COND_INITIALIZER;
-bool g_start = false;
+pthread_mutex_t mutex_file  = PTHREAD_MUTEX_INITIALIZER;
+FILE* g_query_file;
 
 void print_usage(char* progname)
 {
-	fprintf(stderr, "%s –q queryFile -w numThreads –sip servIP –sp servPort\n", progname);
+	fprintf(stderr, "%s –q queryFile -w numConnections –sip servIP –sp servPort "
+	        "[-b batchSize] [-r queriesPerSec [-t seconds]]\n", progname);
 	exit(EXIT_FAILURE);
 }
 
 void parse_cla(int argc, char** argv)
 {
-	if (argc != 9)
+	if (argc < 9 || argc > 15 || argc%2 == 0)
 		print_usage(argv[0]);
 
+	g_cla.batch_size = 1;
+	g_cla.rate       = 0;
+	g_cla.duration   = 10;
+
 	for (int i = 1; i < argc; ++i) {
 		if (!strcmp(argv[i], "-q"))
 			g_cla.query_filepath = argv[++i];
@@ -58,6 +107,15 @@ void parse_cla(int argc, char** argv)
 		else if (!strcmp(argv[i], "-sp"))
 			g_cla.srv_port = getint(argv[++i], 0);
 
+		else if (!strcmp(argv[i], "-b"))
+			g_cla.batch_size = getint(argv[++i], 0);
+
+		else if (!strcmp(argv[i], "-r"))
+			g_cla.rate = getint(argv[++i], 0);
+
+		else if (!strcmp(argv[i], "-t"))
+			g_cla.duration = getint(argv[++i], 0);
+
 		else {
 			fprintf(stderr, "Unknown argument %s:\n", argv[i]);
 			print_usage(argv[0]);
@@ -65,25 +123,84 @@ void parse_cla(int argc, char** argv)
 	}
 
 	if (g_cla.nthreads <= 0)
-		err_exit("Invalid number of threads");
+		err_exit("Invalid number of connections");
+
+	if (g_cla.batch_size <= 0)
+		err_exit("Invalid batch size");
+
+	if (g_cla.rate < 0)
+		err_exit("Invalid rate");
+
+	if (g_cla.duration <= 0)
+		err_exit("Invalid duration");
+
+	// Latencies are per query
+	if (g_cla.rate && g_cla.batch_size != 1)
+		err_exit("Batches cannot be benchmarked");
+}
+
+/* Read the next request off the query file: a single query, or up to batchSize of
+ * them in a batch.
+ * Return value:
+ * The request, or NULL at the end of the file
+ * */
+char* read_request(FILE* query_file)
+{
+	Strbuf* batch;
+	char*  query = NULL;
+	size_t query_size = 0;
+	int i;
+
+	if (g_cla.batch_size == 1) {
+		if (getline(&query, &query_size, query_file) == -1) {
+			free(query);
+			return NULL;
+		}
+		return query;
+	}
+
+	batch = strbuf_init();
+	strbuf_append(batch, BATCH_PREFIX);
+
+	for (i = 0; i < g_cla.batch_size &&
+	            getline(&query, &query_size, query_file) != -1; ++i)
+	{
+		strbuf_append(batch, query);
+		if (batch->buf[batch->len -1] != '\n')
+			strbuf_append(batch, "\n");
+	}
+	free(query);
+
+	if (!i) {
+		strbuf_free(batch);
+		return NULL;
+	}
+
+	return strbuf_steal(batch);
 }
 
 int main(int argc, char** argv)
 {
 	struct sockaddr_in srv_addr;
 	struct in_addr srv_ip;
-	FILE*  query_file;
-	char*  query = NULL;
-	size_t query_size = 0;
+	Vector* mix = NULL;
+	long start = 0;
+	long sent  = 0;
 	int i, j;
 
 	parse_cla(argc, argv);
 
+	// A lost connection is reported by write() instead
+	signal(SIGPIPE, SIG_IGN);
+
 	// Open query file
-	query_file = fopen(g_cla.query_filepath, "r");
-	if (!query_file)
+	g_query_file = fopen(g_cla.query_filepath, "r");
+	if (!g_query_file)
 		syserr_exit("Cannot open \"%s\"", g_cla.query_filepath);
 
+	if (g_cla.rate)
+		mix = bench_load(g_query_file);
+
 	// Convert IP
 	if (!inet_pton(AF_INET, g_cla.srv_ip, &srv_ip))
 		err_exit("Invalid IP address");
@@ -93,84 +210,427 @@ int main(int argc, char** argv)
 	srv_addr.sin_port   = htons(g_cla.srv_port);
 	srv_addr.sin_addr   = srv_ip;
 
-	// Read query file and create threads
-	struct handler_data data[g_cla.nthreads];
-	pthread_t         thread[g_cla.nthreads];
+	// Open the connections. Each one takes the next request off the query file as
+	// soon as it has room, so a slow query only holds up its own connection
+	struct conn_data data[g_cla.nthreads];
+	pthread_t sender[g_cla.nthreads];
+	pthread_t receiver[g_cla.nthreads];
+
+	for (i = 0; i < g_cla.nthreads; ++i) {
+		data[i].inflight = list_init();
+		data[i].sent_all = false;
+		pthread_mutex_init(&data[i].mutex, NULL);
+		pthread_cond_init(&data[i].cond, NULL);
+		data[i].last_reply = 0;
+		data[i].out     = g_cla.rate ? strbuf_init() : NULL;
+		data[i].dropped = 0;
+		data[i].lost    = false;
+		for (j = 0; j <= LAST; ++j)
+			data[i].latency[j] = g_cla.rate ? hist_init() : NULL;
+
+		if ((data[i].fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+			syserr_exit("socket()");
+
+		// Requests are small and sent back to back. Do not hold them back
+		setsockopt(data[i].fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+
+		if (connect(data[i].fd, (struct sockaddr *)&srv_addr,
+		            (socklen_t)sizeof(srv_addr)))
+			syserr_exit("connect()");
+
+		// The benchmark schedule must not stall on a server that stops reading
+		if (g_cla.rate && fcntl(data[i].fd, F_SETFL, O_NONBLOCK) == -1)
+			syserr_exit("fcntl()");
+
+		// A benchmark is sent from here, on a schedule of its own
+		if ((!g_cla.rate &&
+		     pthread_create(&sender[i], NULL, conn_sender, &data[i])) ||
+		    pthread_create(&receiver[i], NULL, conn_receiver, &data[i]))
+			syserr_exit("pthread_create()");
+	}
+
+	if (g_cla.rate) {
+		start = now_us();
+		sent  = bench_dispatch(data, mix, start);
+	}
 
-	for (i = 0; getline(&query, &query_size, query_file) != -1; ++i) {
+	for (i = 0; i < g_cla.nthreads; ++i) {
+		if (!g_cla.rate)
+			pthread_join(sender[i], NULL);
+		pthread_join(receiver[i], NULL);
+	}
 
-		data[i].srv_addr = srv_addr;
-		data[i].query    = xstrdup(query);
+	// Once every reply is in
+	if (g_cla.rate)
+		bench_report(data, start, sent);
 
-		if (pthread_create(&thread[i], NULL, query_handler, &data[i]))
-			syserr_exit("pthread_create()");
+	for (i = 0; i < g_cla.nthreads; ++i) {
+
+		close(data[i].fd);
+		list_free(data[i].inflight, free);
+		pthread_mutex_destroy(&data[i].mutex);
+		pthread_cond_destroy(&data[i].cond);
+		for (j = 0; j <= LAST; ++j)
+			hist_free(data[i].latency[j]);
+		if (data[i].out)
+			strbuf_free(data[i].out);
+	}
+
+	vector_free(mix, free);
+	fclose(g_query_file);
+
+	return 0;
+}
+
+char* next_request(void)
+{
+	char* request;
+
+	pthread_mutex_lock(&mutex_file);
+	request = read_request(g_query_file);
+	pthread_mutex_unlock(&mutex_file);
 
-		// Commence execution of threads
-		if (i == g_cla.nthreads -1) {
-			pthread_mutex_lock(&mutex);
-			g_start = true;
-			pthread_mutex_unlock(&mutex);
+	return request;
+}
+
+/* Send requests until the query file runs out, keeping up to PIPELINE_DEPTH of them
+ * unanswered */
+void* conn_sender(void* data)
+{
+	struct conn_data* d = data;
+	char* request;
+
+	for (;;) {
+		pthread_mutex_lock(&d->mutex);
+		while (d->inflight->size >= PIPELINE_DEPTH)
+			pthread_cond_wait(&d->cond, &d->mutex);
+		pthread_mutex_unlock(&d->mutex);
+
+		if ((request = next_request()) == NULL)
+			break;
+
+		// Queued before it is sent, so that the receiver knows what the reply is for
+		pthread_mutex_lock(&d->mutex);
+		list_append(d->inflight, request);
+		pthread_cond_broadcast(&d->cond);
+		pthread_mutex_unlock(&d->mutex);
+
+		if (write_msg(d->fd, request))
+			break;
+	}
 
-			pthread_cond_broadcast(&cond);
+	pthread_mutex_lock(&d->mutex);
+	d->sent_all = true;
+	pthread_cond_broadcast(&d->cond);
+	pthread_mutex_unlock(&d->mutex);
 
-			for (j = 0; j <= i; ++j) {
-				pthread_join(thread[j], NULL);
-				free(data[j].query);
-			}
+	return NULL;
+}
 
-			i = -1;
-			g_start = false;
+void* conn_receiver(void* data)
+{
+	struct conn_data* d = data;
+	Msg_reader* reader = msg_reader_init(d->fd);
+	void* request;
+
+	for (;;) {
+		pthread_mutex_lock(&d->mutex);
+		while (!d->inflight->size && !d->sent_all)
+			pthread_cond_wait(&d->cond, &d->mutex);
+
+		if (!d->inflight->size) {
+			pthread_mutex_unlock(&d->mutex);
+			break;
 		}
+		request = d->inflight->head->data;
+		pthread_mutex_unlock(&d->mutex);
+
+		if (g_cla.rate)
+			bench_reply(d, reader, request);
+		else
+			print_reply(reader, request);
+
+		pthread_mutex_lock(&d->mutex);
+		list_pop(d->inflight);
+		pthread_cond_broadcast(&d->cond);
+		pthread_mutex_unlock(&d->mutex);
+
+		free(request);
 	}
 
-	pthread_mutex_lock(&mutex);
-	g_start = true;
-	pthread_mutex_unlock(&mutex);
+	msg_reader_free(reader);
+
+	return NULL;
+}
+
+/* Print every query of the request along with its reply, in order. The output is
+ * collected in full first and printed at once, so that a slow reply does not hold up
+ * the replies on the other connections */
+void print_reply(Msg_reader* reader, const char* request)
+{
+	const char* query = request;
+	const char* nl;
+	bool batched = !strncmp(request, BATCH_PREFIX, strlen(BATCH_PREFIX));
+	Strbuf* out = strbuf_init();
+	char* reply;
+	ssize_t len;
+	size_t qlen;
+
+	if (batched)
+		query += strlen(BATCH_PREFIX);
 
-	pthread_cond_broadcast(&cond);
+	for (;;) {
+		// The last query of a batch may lack its newline
+		nl   = batched ? strchr(query, '\n') : NULL;
+		qlen = nl ? nl -query +1 : strlen(query);
+
+		strbuf_appendn(out, query, qlen);
+		while ((len = read_msg_buffered(reader, &reply)) > 0) {
+			strbuf_append(out, reply);
+			free(reply);
+		}
+		strbuf_append(out, "\n");
 
-	for (j = 0; j < i; ++j) {
-		pthread_join(thread[j], NULL);
-		free(data[j].query);
+		query += qlen;
+		if (!*query)
+			break;
 	}
 
+	pthread_mutex_lock(&mutex_print);
+	fwrite(out->buf, 1, out->len, stdout);
+	pthread_mutex_unlock(&mutex_print);
+
+	strbuf_free(out);
+}
+
+long now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec*1000000 +ts.tv_nsec/1000;
+}
+
+/* Read the query mix: every non-empty line is a query, to be sent as often as it
+ * appears.
+ * Return value:
+ * The queries, without their newlines
+ * */
+Vector* bench_load(FILE* query_file)
+{
+	Vector* mix = vector_init();
+	char*  query = NULL;
+	size_t query_size = 0;
+	ssize_t len;
+
+	while ((len = getline(&query, &query_size, query_file)) != -1) {
+		if (len && query[len -1] == '\n')
+			query[--len] = '\0';
+		if (len)
+			vector_append(mix, xstrdup(query));
+	}
 	free(query);
-	fclose(query_file);
 
-	return 0;
+	if (!mix->size)
+		err_exit("No queries in \"%s\"", g_cla.query_filepath);
+
+	return mix;
 }
 
-void* query_handler(void* data)
+/* Return value:
+ * The command of a query, or LAST if it is not one
+ * */
+Command_val bench_command(const char* query)
 {
-	struct handler_data* d = data;
-	int cln_fd;
-	char* reply;
+	Command* command;
+	char* name;
 
-	pthread_mutex_lock(&mutex);
+	name = xstrdup(query);
+	name[strcspn(name, " \t")] = '\0';
+	command = get_command(name);
+	free(name);
 
-	while (g_start == false)
-		pthread_cond_wait(&cond, &mutex);
+	return command ? command->val : LAST;
+}
 
-	pthread_mutex_unlock(&mutex);
+/* Send queries drawn at random from the mix, at Poisson arrivals of the configured
+ * rate, across the connections in turn. The schedule does not wait for replies, and
+ * latencies are counted from when a query was due rather than when it went out, so
+ * that a server falling behind shows in them. Nor does it wait for a server that
+ * stops reading: a query due on a connection with BENCH_OUT_MAX bytes still unsent
+ * is dropped.
+ * Return value:
+ * The number of queries sent
+ * */
+long bench_dispatch(struct conn_data* data, Vector* mix, long start)
+{
+	struct conn_data* d;
+	struct bench_req* req;
+	const char* query;
+	long end   = start +g_cla.duration*1000000L;
+	long next  = start;
+	long sent  = 0;
+	long n     = 0;
+	int i;
 
-	if ((cln_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
-		syserr_exit("socket()");
+	srand48(start);
 
-	if (connect(cln_fd, (struct sockaddr *)&d->srv_addr, (socklen_t)sizeof(d->srv_addr)))
-		syserr_exit("connect()");
+	while (next < end) {
+		bench_flush(data, next);
 
-	write_msg(cln_fd, d->query);
+		query = mix->entry[lrand48() % mix->size];
+		d = &data[n++ % g_cla.nthreads];
 
-	pthread_mutex_lock(&mutex_print);
-	printf("%s", d->query);
-	while (read_msg(cln_fd, &reply)) {
-		printf("%s", reply);
+		if (d->lost || d->out->len >= BENCH_OUT_MAX)
+			d->dropped++;
+		else {
+			req = xmalloc(sizeof(*req));
+			req->sched = next;
+			req->cmd   = bench_command(query);
+
+			pthread_mutex_lock(&d->mutex);
+			list_append(d->inflight, req);
+			pthread_cond_broadcast(&d->cond);
+			pthread_mutex_unlock(&d->mutex);
+
+			msg_append_id(d->out, 0, query);
+			if (msg_flush(d->fd, d->out))
+				d->lost = true;
+			++sent;
+		}
+
+		next += -log(1 -drand48()) / g_cla.rate * 1000000;
+	}
+
+	// The queries already queued are waited on for their replies
+	bench_flush(data, -1);
+
+	for (i = 0; i < g_cla.nthreads; ++i) {
+		pthread_mutex_lock(&data[i].mutex);
+		data[i].sent_all = true;
+		pthread_cond_broadcast(&data[i].cond);
+		pthread_mutex_unlock(&data[i].mutex);
+	}
+
+	return sent;
+}
+
+/* Send the queued queries as the connections take them, until the given time in us,
+ * or until all of them are out if it is -1 */
+void bench_flush(struct conn_data* data, long until)
+{
+	struct pollfd pfd[g_cla.nthreads];
+	struct timespec ts;
+	long now;
+	int timeout;
+	int npending;
+	int i;
+
+	for (;;) {
+		npending = 0;
+		for (i = 0; i < g_cla.nthreads; ++i) {
+			pfd[i].fd     = (data[i].out->len && !data[i].lost) ? data[i].fd : -1;
+			pfd[i].events = POLLOUT;
+			npending += (pfd[i].fd != -1);
+		}
+
+		now = now_us();
+		if (!npending || (until != -1 && now >= until))
+			break;
+
+		// Rounded up, so as not to spin in the last millisecond
+		timeout = (until == -1) ? -1 : (until -now +999)/1000;
+		if (poll(pfd, g_cla.nthreads, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			syserr_exit("poll()");
+		}
+
+		for (i = 0; i < g_cla.nthreads; ++i)
+			if (pfd[i].fd != -1 && pfd[i].revents &&
+			    msg_flush(data[i].fd, data[i].out))
+				data[i].lost = true;
+	}
+
+	if (until != -1 && until > now) {
+		ts.tv_sec  = until/1000000;
+		ts.tv_nsec = until%1000000*1000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+	}
+}
+
+/* Discard the reply to a benchmark query and time it */
+void bench_reply(struct conn_data* d, Msg_reader* reader, struct bench_req* req)
+{
+	char* reply;
+	ssize_t len;
+	long now;
+
+	while ((len = read_msg_buffered(reader, &reply)) > 0)
 		free(reply);
+
+	// The connection was lost. The query goes unanswered
+	if (len == -1)
+		return;
+
+	now = now_us();
+	hist_record(d->latency[req->cmd], now -req->sched);
+	d->last_reply = now;
+}
+
+void bench_report(struct conn_data* data, long start, long sent)
+{
+	static const double pct[] = { 50, 90, 99, 99.9 };
+	Hist* total = hist_init();
+	Hist* cmd;
+	Command* command;
+	const char* name;
+	long last = start;
+	long dropped = 0;
+	double secs;
+	int i, j, k;
+
+	printf("%-22s %9s %9s %9s %9s %9s %9s %9s\n",
+	       "command", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+
+	for (j = 0; j <= LAST; ++j) {
+		cmd = hist_init();
+		for (i = 0; i < g_cla.nthreads; ++i)
+			hist_merge(cmd, data[i].latency[j]);
+
+		if (cmd->n) {
+			command = get_command_by_val(j);
+			name = command ? command->name : "(other)";
+
+			printf("%-22s %9lu %9.3f", name, (unsigned long)cmd->n, hist_mean(cmd)/1000);
+			for (k = 0; k < 4; ++k)
+				printf(" %9.3f", hist_percentile(cmd, pct[k])/1000.0);
+			printf(" %9.3f\n", cmd->max/1000.0);
+		}
+
+		hist_merge(total, cmd);
+		hist_free(cmd);
 	}
-	printf("\n");
-	pthread_mutex_unlock(&mutex_print);
 
-	close(cln_fd);
+	printf("%-22s %9lu %9.3f", "all", (unsigned long)total->n, hist_mean(total)/1000);
+	for (k = 0; k < 4; ++k)
+		printf(" %9.3f", hist_percentile(total, pct[k])/1000.0);
+	printf(" %9.3f\n", total->n ? total->max/1000.0 : 0);
+	printf("Latencies in ms\n\n");
 
-	return NULL;
+	for (i = 0; i < g_cla.nthreads; ++i)
+		if (data[i].last_reply > last)
+			last = data[i].last_reply;
+	secs = (last -start)/1e6;
+
+	for (i = 0; i < g_cla.nthreads; ++i)
+		dropped += data[i].dropped;
+
+	printf("Sent %ld queries at %.1f/s, over %d connections, %ld dropped unsent\n",
+	       sent, sent/(double)g_cla.duration, g_cla.nthreads, dropped);
+	printf("Answered %lu (%.1f/s), %ld unanswered\n", (unsigned long)total->n,
+	       secs > 0 ? total->n/secs : 0, sent -(long)total->n);
+
+	hist_free(total);
 }
@@ -1,55 +1,254 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include <errno.h>
 #include <assert.h>
 #include <unistd.h>
 #include <signal.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <limits.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include "cirq_buffer.h"
 #include "tools.h"
 #include "msg.h"
 #include "vector.h"
 #include "command.h"
+#include "hashtable.h"
+#include "list.h"
+#include "cache.h"
+#include "cube.h"
+#include "stats.h"
+#include "strbuf.h"
+#include "bloom.h"
 
 #define BACKLOG 128
+#define PARK_TIMEOUT_MS 5000
+#define CACHE_SIZE 1024
+#define MAX_EVENTS 64
+#define BATCH_WINDOW 256   // Sub-queries in flight over a worker connection
+#define QUERY_MAX_LEN (4u << 20)   // Largest request a client may send
+
+/* What to do with a connection that arrives while its type is at capacity */
+typedef enum {
+	ADMIT_DROP = 0,  // Reply that the server is busy and close it
+	ADMIT_BLOCK,     // Stop accepting; it waits in the kernel's listen backlog
+	ADMIT_PARK       // Accept it into an overflow queue until room frees or it expires
+} Admit_mode;
+
+typedef enum {
+	QUERY = 0,
+	STATS,
+} Conn_type;
 
 struct CLA {
 	int query_port;
 	int stats_port;
 	int nthreads;
+	int nreactors;
 	int buffer_size;
+	int capacity[2];   // Per connection type limit of queued connections
+	int park_timeout;  // In milliseconds
+	int cache_size;    // Cached query results, 0 to disable the cache
+	Admit_mode admit_mode;
 };
 
-typedef enum {
-	QUERY = 0,
-	STATS,
-} Conn_type;
+typedef struct {
+	int fd;
+	Msg_reader* reader;
+} Worker_conn;
+
+/* A worker's address along with a pool of idle connections to it. Connections are
+ * kept open across queries and handed to one query handler at a time. A worker is
+ * freed once it has been replaced and the queries still asking it are done. */
+typedef struct {
+	struct sockaddr_in addr;
+	pthread_mutex_t mutex;
+	Vector* idle;
+	Bloom* ids;     // The patient ids it holds, NULL until published
+	atomic_int refs;
+} Worker;
 
 typedef struct {
 	Conn_type type;
 	int fd;
 	struct sockaddr_in addr;
 	socklen_t addrlen;
+	Msg_reader* reader;
+	char* query;       // The request, or message, once the reactor has read it in full
+	ssize_t len;       // Its length, 0 for the empty message
+	long deadline;     // Monotonic time in ms after which a parked connection expires
+	int epfd;          // Of the reactor reading the client's requests
+
+	// What a worker has told about itself so far over a statistics connection
+	struct sockaddr_in worker_addr;
+	Worker* worker;    // Created by the connection, NULL unless it sent its port
+	bool named;        // worker_addr is known
+	bool registered;   // worker holds shards, to be marked ready at the end
+	bool started;      // Some of the messages have been handled
 } Conn;
 
+/* An event loop owning its own pair of listening sockets (the ports are shared
+ * between reactors through SO_REUSEPORT). It accepts connections and reads requests
+ * without blocking, then hands them to the handler threads. */
+typedef struct {
+	pthread_t thread;
+	int epfd;
+	int srv_fd[2];
+	int wake_fd;         // Room has been freed in the buffer, or shutdown
+	bool accepting[2];   // Whether the listen backlog has been drained
+	atomic_bool want_room;  // Waiting on wake_fd for room to free up
+	List* parked;        // Connections waiting for room in the buffer
+	Cirq_buffer* conns;
+} Reactor;
+
+/* A sub-query to a single worker */
+typedef struct {
+	Worker* worker;
+	const char* query;
+	void* cb_data;  // Passed to the reply callback
+	bool done;
+} Worker_call;
+
+/* The sub-queries to a single worker, pipelined over one of its connections */
+typedef struct {
+	Worker* worker;
+	Worker_conn* wc;
+	Worker_call** calls;
+	int ncalls;
+	int nsent;      // Sent in order, calls[i] with request id base +i +1
+	int ndone;      // Replied to in full
+	int nrecv;      // Frames received
+	uint32_t base;
+	bool pooled;
+	Strbuf* out;    // Sub-queries yet to be written. The socket is never waited on
+} Worker_link;
+
+/* Called for every chunk of a worker's reply. A chunk holds whole lines */
+typedef void (*Reply_cb)(char* chunk, void* cb_data);
+
+/* A worker holding a country, or the range of its dates a shard spans */
+typedef struct {
+	int from;       // Admissions in [from, until), dates as yyyymmdd
+	int until;
+	Worker* worker;
+	bool ready;     // The worker's initial statistics are all in the cube
+} Route;
+
+typedef struct {
+	char* country;
+	int n;
+} Country_count;
+
 struct conn_handler_data {
 	Cirq_buffer* conns;
-	Vector* worker_addrs;
+	Reactor* reactors;   // To be told when room has been freed
+	Vector* workers;
+	Hashtable* routes;   // Country -> Vector of the Routes to its shards
+};
+
+/* The replies of the workers sharing a country are merged before they are sent */
+struct reply_cb_data {
+	Command_val cmd;
+	int dss_freq_sum;
+	int age_count[STATS_AGE_RANGES];  // Patients per age range
+	bool age_replied;
+	Vector* country_count;   // Admissions/discharges per country, in reply order
+	Strbuf* rows;            // Records, sent once every worker has replied
 };
 
+/* A query of a client's request, from its arrival to its reply */
+typedef struct {
+	char* query;
+	Vector* cmdarg;
+	char* cmdname;
+	Command* command;
+	const char* reply;
+	char* merged;
+	char* cached;
+	char* key;
+	char* tag;
+	unsigned long epoch;
+	bool fanout;             // To be asked of the workers
+	struct reply_cb_data cb_data;
+	char dss_freq_str[32];
+	char*  logbuf;
+	size_t loglen;
+	size_t logpos;
+	FILE*  log;
+} Query;
+
 void print_usage(char* progname);
 void parse_cla(int argc, char** argv);
 
 Conn* conn_init(Conn_type type);
 void  conn_free(Conn* conn);
+void  conn_reject(Conn* conn, const char* errmsg);
+void  conn_watch(Conn* conn);
+int   conn_next_query(Conn* conn);
+bool  conn_admissible(Conn_type type);
+bool  conn_admit(Cirq_buffer* cb, Conn* conn);
+void  conns_unpark(Cirq_buffer* cb, List* parked);
+long  now_ms(void);
+void  set_blocking(int fd, bool blocking);
+
+void  reactor_init(Reactor* r, Cirq_buffer* conns);
+void  reactor_free(Reactor* r);
+void* reactor_loop(void* data);
+void  reactor_accept(Reactor* r, Conn_type type);
+void  reactor_read(Reactor* r, Conn* conn);
+void  reactor_dispatch(Reactor* r, Conn* conn);
+void  reactors_wake(Reactor* reactors, bool all);
 void* conn_handler(void* data);
-void  conn_stats_handler(Conn* conn, Vector* worker_addrs);
-void  conn_query_handler(Conn* conn, Vector* worker_addrs);
+int   conn_stats_handler(Conn* conn, Vector* workers, Hashtable* routes);
+void  conn_query_handler(Conn* conn, Vector* workers, Hashtable* routes);
+Query* query_init(char* query);
+void  query_answer(Query* q, Hashtable* routes);
+int   query_calls(Query* q, Vector* workers, Hashtable* routes, Worker_call* calls);
+void  query_reply(Query* q, Conn* conn);
+void  log_flush(char* logbuf, size_t loglen);
+char* query_key(Vector* cmdarg);
+void  stats_store(const char* msg, size_t len);
+void  stats_record_cb(const char* country, const char* virus, int date,
+                      const int count[STATS_AGE_RANGES], void* cb_data);
+bool  cube_reply(Command* command, Vector* cmdarg, Hashtable* routes, char** reply);
+bool  routes_ready(Hashtable* routes, const char* country);
+void  routes_set_ready(Hashtable* routes, Worker* w);
+
+Worker* worker_init(const struct sockaddr_in* addr);
+Worker* worker_get(Worker* w);
+void    worker_put(Worker* w);
+void    worker_put_generic(void* w);
+int     worker_comp(const void* w1, const void* w2);
+int     worker_link_send(Worker_link* link);
+int     worker_link_recv(Worker_link* link, Reply_cb cb);
+void    workers_fanout(Worker_call* calls, int ncalls, Reply_cb cb);
+void    workers_register(Vector* workers, Hashtable* routes, Worker* w,
+                         Vector* shards);
+int     workers_route(Hashtable* routes, Command* command, Vector* cmdarg,
+                      Worker** workers, int max);
+int     workers_find_id(Vector* workers, const char* id, Worker** holders);
+void    workers_set_ids(Vector* workers, const struct sockaddr_in* addr, Bloom* ids);
+void    routes_drop(Hashtable* routes, Worker* w);
+void    routes_free_generic(void* routes);
+void    reply_cb(char* reply, void* cb_data);
+void    reply_counts_add(struct reply_cb_data* data, char* reply);
+void    country_count_free(void* cc);
+Worker_conn* worker_conn_get(Worker* w, bool* pooled);
+void    worker_conn_put(Worker* w, Worker_conn* wc);
+void    worker_conn_free(Worker_conn* wc);
+void    worker_conn_free_generic(void* wc);
 
 int create_socket(int port);
 struct sockaddr_in create_addr(int port);
@@ -60,23 +259,35 @@ void sigact(void);
 // Globals
 struct CLA g_cla;
 pthread_mutex_t mutex_print = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t mutex_buf   = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t  cond_avail  = PTHREAD_COND_INITIALIZER;
-int g_avail;
+pthread_rwlock_t rwlock_workers = PTHREAD_RWLOCK_INITIALIZER;
 int g_sigint;
+atomic_uint g_reqid;
+atomic_int  g_queued[2];  // Queued connections per type
+Cache* g_cache;           // Query -> reply, NULL if disabled
+Cube*  g_cube;            // The workers' statistics
+int g_nroutes;            // Routes, and the ones ready. Guarded by rwlock_workers
+int g_nready;
 
 void print_usage(char* progname)
 {
-	fprintf(stderr, "%s –q queryPort -s statisticsPort –w numThreads –b bufferSize\n",
-	        progname);
+	fprintf(stderr, "%s –q queryPort -s statisticsPort –w numThreads –b bufferSize "
+	        "[-r numReactors] [-m drop|block|park] [-bq queryCapacity] "
+	        "[-bs statsCapacity] [-t parkTimeoutMs] [-c cacheSize]\n", progname);
 	exit(EXIT_FAILURE);
 }
 
 void parse_cla(int argc, char** argv)
 {
-	if (argc != 9)
+	char* mode;
+
+	if (argc < 9)
 		print_usage(argv[0]);
 
+	g_cla.admit_mode   = ADMIT_BLOCK;
+	g_cla.park_timeout = PARK_TIMEOUT_MS;
+	g_cla.nreactors    = 1;
+	g_cla.cache_size   = CACHE_SIZE;
+
 	for (int i = 1; i < argc; ++i) {
 		if (!strcmp(argv[i], "-q"))
 			g_cla.query_port  = getint(argv[++i], 0);
@@ -87,9 +298,35 @@ void parse_cla(int argc, char** argv)
 		else if (!strcmp(argv[i], "-w"))
 			g_cla.nthreads    = getint(argv[++i], 0);
 
+		else if (!strcmp(argv[i], "-r"))
+			g_cla.nreactors   = getint(argv[++i], 0);
+
 		else if (!strcmp(argv[i], "-b"))
 			g_cla.buffer_size = getint(argv[++i], 0);
 
+		else if (!strcmp(argv[i], "-bq"))
+			g_cla.capacity[QUERY] = getint(argv[++i], 0);
+
+		else if (!strcmp(argv[i], "-bs"))
+			g_cla.capacity[STATS] = getint(argv[++i], 0);
+
+		else if (!strcmp(argv[i], "-t"))
+			g_cla.park_timeout = getint(argv[++i], 0);
+
+		else if (!strcmp(argv[i], "-c"))
+			g_cla.cache_size = getint(argv[++i], 0);
+
+		else if (!strcmp(argv[i], "-m") && (mode = argv[++i])) {
+			if (!strcmp(mode, "drop"))
+				g_cla.admit_mode = ADMIT_DROP;
+			else if (!strcmp(mode, "block"))
+				g_cla.admit_mode = ADMIT_BLOCK;
+			else if (!strcmp(mode, "park"))
+				g_cla.admit_mode = ADMIT_PARK;
+			else
+				err_exit("Unknown admission mode %s", mode);
+		}
+
 		else {
 			fprintf(stderr, "Unknown argument %s:\n", argv[i]);
 			print_usage(argv[0]);
@@ -99,8 +336,25 @@ void parse_cla(int argc, char** argv)
 	if (g_cla.nthreads <= 0)
 		err_exit("Invalid number of threads");
 
+	if (g_cla.nreactors <= 0)
+		err_exit("Invalid number of reactors");
+
 	if (g_cla.buffer_size <= 0)
 		err_exit("Invalid buffer size");
+
+	// Each type may take up the whole buffer unless limited
+	for (int i = 0; i < 2; ++i) {
+		if (g_cla.capacity[i] < 0)
+			err_exit("Invalid capacity");
+		if (g_cla.capacity[i] == 0 || g_cla.capacity[i] > g_cla.buffer_size)
+			g_cla.capacity[i] = g_cla.buffer_size;
+	}
+
+	if (g_cla.park_timeout < 0)
+		err_exit("Invalid park timeout");
+
+	if (g_cla.cache_size < 0)
+		err_exit("Invalid cache size");
 }
 
 void signal_handler(int signum)
@@ -122,16 +376,25 @@ void sigact(void)
 	sigact.sa_flags = 0;
 
 	sigaction(SIGINT, &sigact, NULL);
+
+	// A worker going away must not take the server down with it
+	sigact.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sigact, NULL);
 }
 
 int create_socket(int port)
 {
 	struct sockaddr_in addr;
+	int reuse = 1;
 	int fd;
 
-	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+	if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
 		syserr_exit("socket()");
 
+	// Every reactor listens on the same ports and the kernel spreads connections
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)))
+		syserr_exit("setsockopt()");
+
 	addr = create_addr(port);
 
 	if (bind(fd, (struct sockaddr *)&addr, (socklen_t)sizeof(addr)))
@@ -161,87 +424,350 @@ int main(int argc, char** argv)
 	struct conn_handler_data data;
 	Cirq_buffer* cb;
 	Vector* v;
-	Conn* conn;
-	fd_set srv_fds;
-	int srv_fd[2];
+	sigset_t sigint_set;
+	sigset_t oldmask;
 	int i;
 
 	sigact();
 	parse_cla(argc, argv);
 
-	srv_fd[QUERY] = create_socket(g_cla.query_port);
-	srv_fd[STATS] = create_socket(g_cla.stats_port);
-
 	cb = cirq_buffer_init(g_cla.buffer_size);
+	if (!cb)
+		syserr_exit("cirq_buffer_init()");
 	v  = vector_init();
 
+	if (g_cla.cache_size)
+		g_cache = cache_init(g_cla.cache_size);
+
+	g_cube = cube_init();
+
+	Reactor reactor[g_cla.nreactors];
+
+	for (i = 0; i < g_cla.nreactors; ++i)
+		reactor_init(&reactor[i], cb);
+
 	data.conns = cb;
-	data.worker_addrs = v;
+	data.reactors = reactor;
+	data.workers  = v;
+	data.routes   = hashtable_init(100, hashtable_min_bucket_size());
 
 	pthread_t thread[g_cla.nthreads];
 
+	// Only the main thread waits for SIGINT. Every other thread inherits the mask
+	sigemptyset(&sigint_set);
+	sigaddset(&sigint_set, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &sigint_set, &oldmask);
+
 	for (i = 0; i < g_cla.nthreads; ++i)
 		if (pthread_create(&thread[i], NULL, conn_handler, &data))
 			syserr_exit("pthread_create()");
 
+	for (i = 0; i < g_cla.nreactors; ++i)
+		if (pthread_create(&reactor[i].thread, NULL, reactor_loop, &reactor[i]))
+			syserr_exit("pthread_create()");
+
+	while (!g_sigint)
+		sigsuspend(&oldmask);
+
+	// The reactors check g_sigint whenever they wake up
+	reactors_wake(reactor, true);
+
+	for (i = 0; i < g_cla.nreactors; ++i)
+		if (pthread_join(reactor[i].thread, NULL))
+			syserr_exit("pthread_join()");
+
+	cirq_buffer_close(cb);
+
+	for (i = 0; i < g_cla.nthreads; ++i)
+		if (pthread_join(thread[i], NULL))
+			syserr_exit("pthread_join()");
+
+	for (i = 0; i < g_cla.nreactors; ++i)
+		reactor_free(&reactor[i]);
+
+	cirq_buffer_free(cb);
+	hashtable_free(data.routes, routes_free_generic);
+	vector_free(v, worker_put_generic);
+	cache_free(g_cache);
+	cube_free(g_cube);
+
+	return 0;
+}
+
+void reactor_init(Reactor* r, Cirq_buffer* conns)
+{
+	struct epoll_event ev;
+	int i;
+
+	r->conns  = conns;
+	r->parked = list_init();
+	atomic_init(&r->want_room, false);
+
+	r->srv_fd[QUERY] = create_socket(g_cla.query_port);
+	r->srv_fd[STATS] = create_socket(g_cla.stats_port);
+
+	if ((r->wake_fd = eventfd(0, EFD_NONBLOCK)) == -1)
+		syserr_exit("eventfd()");
+
+	if ((r->epfd = epoll_create1(0)) == -1)
+		syserr_exit("epoll_create1()");
+
+	// Listening sockets and the wake eventfd are told apart from connections by the
+	// address of their fd inside the reactor
+	for (i = 0; i < 2; ++i) {
+		ev.events   = EPOLLIN | EPOLLET;
+		ev.data.ptr = &r->srv_fd[i];
+		if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->srv_fd[i], &ev))
+			syserr_exit("epoll_ctl()");
+
+		r->accepting[i] = true;
+	}
+
+	ev.events   = EPOLLIN | EPOLLET;
+	ev.data.ptr = &r->wake_fd;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->wake_fd, &ev))
+		syserr_exit("epoll_ctl()");
+}
+
+void reactor_free(Reactor* r)
+{
+	Conn* conn;
+
+	while ((conn = list_pop(r->parked)))
+		conn_free(conn);
+	list_free(r->parked, NULL);
+
+	close(r->epfd);
+	close(r->wake_fd);
+	close(r->srv_fd[QUERY]);
+	close(r->srv_fd[STATS]);
+}
+
+void* reactor_loop(void* data)
+{
+	struct epoll_event ev[MAX_EVENTS];
+	Reactor* r = data;
+	Conn* conn;
+	uint64_t wakeups;
+	bool want_room;
+	long timeout;
+	int nev;
+	int i;
+
 	for (;;) {
-		FD_ZERO(&srv_fds);
-		FD_SET(srv_fd[QUERY], &srv_fds);
-		FD_SET(srv_fd[STATS], &srv_fds);
+		// Ask for a wakeup before looking for room, so that room freed right after the
+		// check is never missed
+		atomic_store(&r->want_room, true);
 
-		if (select(srv_fd[STATS] +1, &srv_fds, NULL, NULL, NULL) == -1) {
-			if (g_sigint) break;
+		conns_unpark(r->conns, r->parked);
+		want_room = (r->parked->size != 0);
 
-			syserr_exit("select()");
+		// Resume accepting from a backlog that was left alone for lack of room
+		for (i = 0; i < 2; ++i) {
+			if (!r->accepting[i])
+				reactor_accept(r, i);
+			if (!r->accepting[i])
+				want_room = true;
 		}
 
-		for (i = 0; i < 2; ++i) {
-			if (FD_ISSET(srv_fd[i], &srv_fds)) {
+		if (!want_room)
+			atomic_store(&r->want_room, false);
+
+		// Wake up in time to expire the oldest parked connection
+		timeout = -1;
+		if (r->parked->size) {
+			conn = r->parked->head->data;
+			if (conn->deadline != LONG_MAX) {
+				timeout = conn->deadline -now_ms();
+				if (timeout < 0)
+					timeout = 0;
+			}
+		}
+
+		nev = epoll_wait(r->epfd, ev, MAX_EVENTS, timeout);
+		if (nev == -1) {
+			if (errno == EINTR) continue;
+			syserr_exit("epoll_wait()");
+		}
+
+		if (g_sigint)
+			break;
 
-				conn = conn_init(i);
+		for (i = 0; i < nev; ++i) {
+			if (ev[i].data.ptr == &r->wake_fd) {
+				if (read(r->wake_fd, &wakeups, sizeof(wakeups)) == -1 &&
+				    errno != EAGAIN)
+					syserr_exit("read()");
+			}
+			else if (ev[i].data.ptr == &r->srv_fd[QUERY])
+				reactor_accept(r, QUERY);
+
+			else if (ev[i].data.ptr == &r->srv_fd[STATS])
+				reactor_accept(r, STATS);
+
+			else
+				reactor_read(r, ev[i].data.ptr);
+		}
+	}
 
-				conn->fd = accept(srv_fd[i], (struct sockaddr*)&conn->addr,
-				                  &conn->addrlen);
-				if (conn->fd == -1)
-					syserr_exit("accept()");
+	return NULL;
+}
 
-				pthread_mutex_lock(&mutex_buf);
+/* Accept connections until the backlog is drained. In blocking admission mode stop
+ * early while the connection type is at capacity, leaving the rest in the backlog */
+void reactor_accept(Reactor* r, Conn_type type)
+{
+	Conn* conn;
+	int fd;
 
-				if (!cirq_buffer_push(cb, conn)) {
-					char* errmsg = "Circular buffer full. Closing connection...\n";
+	for (;;) {
+		if (g_cla.admit_mode == ADMIT_BLOCK && !conn_admissible(type)) {
+			r->accepting[type] = false;
+			return;
+		}
 
-					pthread_mutex_lock(&mutex_print);
-					fprintf(stderr, "%s\n", errmsg);
-					pthread_mutex_unlock(&mutex_print);
+		conn = conn_init(type);
 
-					write_msg(conn->fd, errmsg);
-					write_msg(conn->fd, "");
+		fd = accept4(r->srv_fd[type], (struct sockaddr*)&conn->addr, &conn->addrlen,
+		             SOCK_NONBLOCK);
+		if (fd == -1) {
+			free(conn);
 
-					conn_free(conn);
-					pthread_mutex_unlock(&mutex_buf);
-					continue;
-				}
-				g_avail++;
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
 
-				pthread_mutex_unlock(&mutex_buf);
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept4()");
 
-				pthread_cond_signal(&cond_avail);
-			}
+			r->accepting[type] = true;
+			return;
 		}
+
+		conn->fd = fd;
+		conn->reader = msg_reader_init(fd);
+		conn->epfd = r->epfd;
+
+		// A client declaring a larger request is dropped rather than buffered for
+		if (type == QUERY)
+			conn->reader->max_len = QUERY_MAX_LEN;
+
+		// Replies to pipelined requests go out as soon as they are ready
+		if (type == QUERY)
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+
+		conn_watch(conn);
 	}
+}
 
-	pthread_cond_broadcast(&cond_avail);
+/* Have the connection's reactor read the client's next request, or the worker's next
+ * messages. A peer that has left is noticed there */
+void conn_watch(Conn* conn)
+{
+	struct epoll_event ev;
 
-	for (i = 0; i < g_cla.nthreads; ++i)
-		if (pthread_join(thread[i], NULL))
-			syserr_exit("pthread_join()");
+	ev.events   = EPOLLIN | EPOLLET;
+	ev.data.ptr = conn;
+	if (epoll_ctl(conn->epfd, EPOLL_CTL_ADD, conn->fd, &ev))
+		syserr_exit("epoll_ctl()");
+}
 
-	cirq_buffer_free(cb);
-	vector_free(v, free);
-	close(srv_fd[QUERY]);
-	close(srv_fd[STATS]);
+/* Take the next request the client has pipelined, or the worker's next message, if it
+ * is in already.
+ * Return value:
+ * 1 if conn->query has been set to it, 0 if there is none, -1 if the peer has sent a
+ * malformed frame
+ * */
+int conn_next_query(Conn* conn)
+{
+	int ret;
 
-	return 0;
+	free(conn->query);
+	conn->query = NULL;
+
+	if ((ret = msg_reader_next(conn->reader, &conn->query, &conn->len)) != 1)
+		return ret;
+
+	if (!conn->query)
+		conn->query = xstrdup("");
+
+	return 1;
+}
+
+/* Drain the peer's socket. Once a request, or a worker's message, has arrived in full
+ * the connection leaves the reactor for a handler thread. A worker streams its
+ * statistics for as long as its load takes, so they are handled as they come rather
+ * than by a handler thread waiting on them */
+void reactor_read(Reactor* r, Conn* conn)
+{
+	ssize_t bread;
+	int ret;
+
+	while ((bread = msg_reader_fill(conn->reader)) > 0)
+		;
+
+	if ((ret = msg_reader_next(conn->reader, &conn->query, &conn->len)) == 1) {
+		if (!conn->query)
+			conn->query = xstrdup("");
+
+		if (epoll_ctl(r->epfd, EPOLL_CTL_DEL, conn->fd, NULL))
+			syserr_exit("epoll_ctl()");
+
+		reactor_dispatch(r, conn);
+	}
+	// The peer left before completing its request, or broke the protocol. A worker
+	// that leaves halfway is replaced, and its statistics sent anew
+	else if (bread == 0 || ret == -1)
+		conn_free(conn);
+}
+
+/* Hand a connection over to the handler threads, or park or reject it if its type is
+ * at capacity, depending on the admission mode */
+void reactor_dispatch(Reactor* r, Conn* conn)
+{
+	Admit_mode mode = g_cla.admit_mode;
+
+	set_blocking(conn->fd, true);
+
+	// Parked connections go first
+	if (!r->parked->size && conn_admit(r->conns, conn))
+		return;
+
+	// Turning away a worker halfway through its statistics would lose them
+	if (conn->type == STATS && conn->started)
+		mode = ADMIT_BLOCK;
+
+	switch (mode) {
+	case ADMIT_DROP:
+		conn_reject(conn, "Circular buffer full. Closing connection...\n");
+		return;
+
+	case ADMIT_PARK:
+		conn->deadline = now_ms() +g_cla.park_timeout;
+		break;
+
+	case ADMIT_BLOCK:
+		conn->deadline = LONG_MAX;
+		break;
+	}
+
+	list_append(r->parked, conn);
+}
+
+/* Wake up the reactors waiting for room, or all of them */
+void reactors_wake(Reactor* reactors, bool all)
+{
+	const uint64_t one = 1;
+	Reactor* r;
+
+	for (int i = 0; i < g_cla.nreactors; ++i) {
+		r = &reactors[i];
+
+		if (!atomic_exchange(&r->want_room, false) && !all)
+			continue;
+
+		if (write(r->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+			syserr_exit("write()");
+	}
 }
 
 Conn* conn_init(Conn_type type)
@@ -250,167 +776,1212 @@ Conn* conn_init(Conn_type type)
 
 	conn->type = type;
 	conn->addrlen = (socklen_t)sizeof(conn->addr);
+	conn->reader = NULL;
+	conn->query  = NULL;
+	conn->worker = NULL;
+	conn->named      = false;
+	conn->registered = false;
+	conn->started    = false;
 
 	return conn;
 }
 
 void conn_free(Conn* conn)
 {
+	if (conn->worker)
+		worker_put(conn->worker);
+
+	msg_reader_free(conn->reader);
+	free(conn->query);
 	close(conn->fd);
 	free(conn);
 }
 
-void* conn_handler(void* data)
+void conn_reject(Conn* conn, const char* errmsg)
+{
+	pthread_mutex_lock(&mutex_print);
+	fprintf(stderr, "%s\n", errmsg);
+	pthread_mutex_unlock(&mutex_print);
+
+	write_msg(conn->fd, errmsg);
+	write_msg(conn->fd, "");
+
+	conn_free(conn);
+}
+
+bool conn_admissible(Conn_type type)
+{
+	return atomic_load(&g_queued[type]) < g_cla.capacity[type] &&
+	       atomic_load(&g_queued[QUERY]) +atomic_load(&g_queued[STATS]) <
+	       g_cla.buffer_size;
+}
+
+/* Queue the connection for the handler threads if its type is below capacity.
+ * Return value:
+ * true if the connection was queued
+ * */
+bool conn_admit(Cirq_buffer* cb, Conn* conn)
+{
+	if (!conn_admissible(conn->type))
+		return false;
+
+	atomic_fetch_add(&g_queued[conn->type], 1);
+
+	if (!cirq_buffer_push(cb, conn)) {
+		atomic_fetch_sub(&g_queued[conn->type], 1);
+		return false;
+	}
+
+	return true;
+}
+
+/* Move parked connections into the buffer in arrival order while there is room, then
+ * turn away the ones whose deadline has passed */
+void conns_unpark(Cirq_buffer* cb, List* parked)
 {
-	struct conn_handler_data* chdata = data;
-	Vector* worker_addrs = chdata->worker_addrs;
-	Cirq_buffer* conns   = chdata->conns;
 	Conn* conn;
+	long now;
 
-	for (;;) {
-		pthread_mutex_lock(&mutex_buf);
-		while (g_avail == 0) {
-			if (g_sigint == 1) {
-				pthread_mutex_unlock(&mutex_buf);
-				return NULL;
-			}
+	while (parked->size && conn_admit(cb, parked->head->data))
+		list_pop(parked);
 
-			pthread_cond_wait(&cond_avail, &mutex_buf);
-		}
+	now = now_ms();
+
+	while (parked->size && ((Conn*)parked->head->data)->deadline <= now) {
+		conn = list_pop(parked);
+		conn_reject(conn, "Server busy. Closing connection...\n");
+	}
+}
+
+void set_blocking(int fd, bool blocking)
+{
+	int flags;
 
-		conn = cirq_buffer_pop(conns);
-		if (!conn)
-			err_exit("Expected non-empty buffer");
+	if ((flags = fcntl(fd, F_GETFL)) == -1)
+		syserr_exit("fcntl()");
 
-		g_avail--;
-		pthread_mutex_unlock(&mutex_buf);
+	flags = blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK;
 
+	if (fcntl(fd, F_SETFL, flags) == -1)
+		syserr_exit("fcntl()");
+}
+
+long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec*1000 +ts.tv_nsec/1000000;
+}
+
+void* conn_handler(void* data)
+{
+	struct conn_handler_data* chdata = data;
+	Vector* workers    = chdata->workers;
+	Hashtable* routes  = chdata->routes;
+	Cirq_buffer* conns = chdata->conns;
+	Conn* conn;
+	int ret;
+
+	// A NULL connection means the buffer has been closed
+	while ((conn = cirq_buffer_pop(conns))) {
+		atomic_fetch_sub(&g_queued[conn->type], 1);
 
-		if (conn->type == QUERY)
-			conn_query_handler(conn, worker_addrs);
+		reactors_wake(chdata->reactors, false);
+
+		// Clients keep their connection for further requests. Those pipelined
+		// behind this one are answered right away, in order
+		if (conn->type == QUERY) {
+			do
+				conn_query_handler(conn, workers, routes);
+			while ((ret = conn_next_query(conn)) == 1);
+		}
 
 		else if (conn->type == STATS)
-			conn_stats_handler(conn, worker_addrs);
+			ret = conn_stats_handler(conn, workers, routes);
 
 		else
 			assert(0);
 
-		conn_free(conn);
+		if (ret != 0) {
+			conn_free(conn);
+			continue;
+		}
+
+		// Back to the reactor for what comes next
+		set_blocking(conn->fd, false);
+		conn_watch(conn);
 	}
+
+	return NULL;
 }
 
-void conn_query_handler(Conn* conn, Vector* worker_addrs)
+/* Answer a request: a single query, or a batch of them, one per line. The queries a
+ * batch leaves to the workers are sent out together, so that each worker is asked
+ * for all of them in a single round trip. The replies go out in the queries' order */
+void conn_query_handler(Conn* conn, Vector* workers, Hashtable* routes)
 {
-	struct sockaddr_in* waddr;
-	size_t waddrlen;
-	int wfd;
-	Command* command;
-	Vector* cmdarg;
-	char* cmdname;
-	char* query;
-	char* reply = NULL;
-	char dss_freq_str[32];
-	int dss_freq_sum = 0;
-	int dss_freq;
+	Vector* queries = vector_init();
+	Worker_call* calls;
+	Query* q;
+	char* query = conn->query;
+	char* line;
+	size_t len;
+	int nfanout = 0;
+	int ncalls = 0;
 	int i;
 
-	read_msg(conn->fd, &query);
+	if (strncmp(query, BATCH_PREFIX, strlen(BATCH_PREFIX)))
+		vector_append(queries, query_init(xstrdup(query)));
+	else {
+		for (query += strlen(BATCH_PREFIX); *query; query += len) {
+			len  = strchr(query, '\n') ? strchr(query, '\n') -query +1 : strlen(query);
+			line = xmalloc(len +1);
+			memcpy(line, query, len);
+			line[len] = '\0';
 
-	cmdarg  = tokenize(query, " \n");
-	cmdname = vector_get(cmdarg, 0);
+			vector_append(queries, query_init(line));
+		}
+	}
 
-	// Non-empty command
-	if (cmdname) {
-		pthread_mutex_lock(&mutex_print);
-		printf("%s", query);
+	for (i = 0; i < queries->size; ++i) {
+		q = queries->entry[i];
+		query_answer(q, routes);
+		nfanout += q->fanout;
+	}
 
-		command = get_command(cmdname);
+	// The workers asked are held on to, so that they can be replaced meanwhile
+	if (nfanout) {
+		pthread_rwlock_rdlock(&rwlock_workers);
 
-		if (!command)
-			reply = "Unknown command\n";
+		calls = xmalloc(nfanout*(workers->size +1)*sizeof(*calls));
 
-		else if (cmdarg->size < command->mandargs)
-			reply = "Please provide all the necessary arguments\n";
+		for (i = 0; i < queries->size; ++i) {
+			q = queries->entry[i];
+			if (q->fanout)
+				ncalls += query_calls(q, workers, routes, &calls[ncalls]);
+		}
 
-		else {
-			for (i = 0; i < worker_addrs->size; ++i) {
-				waddr    = worker_addrs->entry[i];
-				waddrlen = sizeof(*waddr);
-
-				if ((wfd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
-					syserr_exit("socket()");
-
-				if (connect(wfd, (struct sockaddr*)waddr, (socklen_t)waddrlen)) {
-					// Worker exited?
-					if (errno == ECONNREFUSED) {
-						close(wfd);
-						continue;
-					}
-					else
-						syserr_exit("connect()");
-				}
-
-				write_msg(wfd, query);
-				read_msg(wfd, &reply);
-
-				if (command->val == DISEASE_FREQUENCY) {
-					dss_freq = getint(reply, 0);
-					if (dss_freq != -1)
-						dss_freq_sum += dss_freq;
-				}
-				else if (reply) {
-					printf("%s", reply);
-					write_msg(conn->fd, reply);
-				}
-				free(reply);
-				reply = NULL;
-
-				close(wfd);
-			}
+		for (i = 0; i < ncalls; ++i)
+			worker_get(calls[i].worker);
 
-			if (command->val == DISEASE_FREQUENCY) {
-				snprintf(dss_freq_str, sizeof(dss_freq_str) -2, "%d\n", dss_freq_sum);
-				reply = dss_freq_str;
-			}
-		}
+		pthread_rwlock_unlock(&rwlock_workers);
 
-		if (reply) {
-			write_msg(conn->fd, reply);
-			printf("%s", reply);
-		}
+		workers_fanout(calls, ncalls, reply_cb);
+
+		for (i = 0; i < ncalls; ++i)
+			worker_put(calls[i].worker);
 
-		printf("\n");
-		pthread_mutex_unlock(&mutex_print);
+		free(calls);
 	}
-	write_msg(conn->fd, "");
-	vector_free(cmdarg, free);
-	free(query);
+
+	for (i = 0; i < queries->size; ++i)
+		query_reply(queries->entry[i], conn);
+
+	vector_free(queries, NULL);
 }
 
-void conn_stats_handler(Conn* conn, Vector* worker_addrs)
+/* Parse a query and start its log. The records it gets from the workers are held
+ * back until it is its turn to reply */
+Query* query_init(char* query)
 {
-	struct sockaddr_in* worker_addr;
-	char* msg;
-	char port_str[7];
-	int  port;
+	Query* q = xcalloc(1, sizeof(*q));
 
-	pthread_mutex_lock(&mutex_print);
-	while (read_msg(conn->fd, &msg)) {
+	q->query   = query;
+	q->cmdarg  = tokenize(query, " \n");
+	q->cmdname = vector_get(q->cmdarg, 0);
 
-		if (!strncmp(msg, "PORT:", 5)) {
-			strcpy(port_str, &msg[5]);
-			port = getint(port_str, 0);
+	// Empty commands get an empty reply and are not logged
+	if (!q->cmdname)
+		return q;
 
-			worker_addr  = xmalloc(sizeof(*worker_addr));
-			*worker_addr = conn->addr;
-			worker_addr->sin_port = htons(port);
-			vector_append(worker_addrs, worker_addr);
-		}
-		else {
-			// printf("%s", msg);
-		}
+	if ((q->log = open_memstream(&q->logbuf, &q->loglen)) == NULL)
+		syserr_exit("open_memstream()");
+
+	fprintf(q->log, "%s", query);
+	fflush(q->log);
+	q->logpos = q->loglen;
+
+	q->cb_data = (struct reply_cb_data){ .rows = strbuf_init() };
+
+	return q;
+}
+
+/* Answer the query if that takes neither the workers nor the cube, or else mark it to
+ * be sent to the workers */
+void query_answer(Query* q, Hashtable* routes)
+{
+	Command* command;
+	Vector* cmdarg = q->cmdarg;
+
+	if (!q->cmdname)
+		return;
+
+	command = q->command = get_command(q->cmdname);
+
+	if (!command)
+		q->reply = "Unknown command\n";
+
+	else if (cmdarg->size < command->mandargs)
+		q->reply = "Please provide all the necessary arguments\n";
 
-		free(msg);
+	else if (g_cache &&
+	         (q->cached = cache_get(g_cache, (q->key = query_key(cmdarg)), &q->epoch)))
+	{
+		q->reply = *q->cached ? q->cached : NULL;
 	}
-	pthread_mutex_unlock(&mutex_print);
+
+	// Aggregates over the admissions are computed from the statistics, without
+	// asking the workers
+	else if (cube_reply(command, cmdarg, routes, &q->merged)) {
+		q->reply = q->merged;
+		if (command->cntrarg_pos && cmdarg->size > command->cntrarg_pos)
+			q->tag = cmdarg->entry[command->cntrarg_pos];
+	}
+
+	else {
+		q->fanout = true;
+		q->cb_data.cmd = command->val;
+		q->cb_data.country_count = vector_init();
+
+		if (command->cntrarg_pos && cmdarg->size > command->cntrarg_pos)
+			q->tag = cmdarg->entry[command->cntrarg_pos];
+	}
+}
+
+/* Place in calls a sub-query for every worker the query concerns. The caller holds
+ * rwlock_workers.
+ * Return value:
+ * The number of sub-queries placed
+ * */
+int query_calls(Query* q, Vector* workers, Hashtable* routes, Worker_call* calls)
+{
+	Worker* owners[workers->size +1];
+	Worker** target = owners;
+	Command* command = q->command;
+	Vector* cmdarg = q->cmdarg;
+	int n;
+	int i;
+
+	// Country-scoped queries only concern the workers holding the country's shards
+	// that span the dates asked for
+	if (command->cntrarg_pos && cmdarg->size > command->cntrarg_pos)
+		n = workers_route(routes, command, cmdarg, owners, workers->size);
+
+	else if (command->val == SEARCH_PATIENT_RECORD)
+		n = workers_find_id(workers, cmdarg->entry[1], owners);
+
+	else {
+		target = (Worker**)workers->entry;
+		n = workers->size;
+	}
+
+	for (i = 0; i < n; ++i)
+		calls[i] = (Worker_call){ .worker = target[i], .query = q->query,
+		                          .cb_data = &q->cb_data };
+
+	return n;
+}
+
+/* Merge what the workers replied, if they were asked, then send the reply followed by
+ * the empty message that ends it. Cache and log it, and free the query */
+void query_reply(Query* q, Conn* conn)
+{
+	struct reply_cb_data* data = &q->cb_data;
+	Country_count* cc;
+	int err;
+	int i;
+
+	if (!q->log) {
+		write_msg(conn->fd, "");
+		goto end;
+	}
+
+	if (q->fanout) {
+		if (data->cmd == DISEASE_FREQUENCY) {
+			snprintf(q->dss_freq_str, sizeof(q->dss_freq_str) -2, "%d\n",
+			         data->dss_freq_sum);
+			q->reply = q->dss_freq_str;
+		}
+		else if (data->cmd == TOPK_AGE_RANGES && data->age_replied) {
+			Strbuf* sb = strbuf_init();
+
+			i = getint(q->cmdarg->entry[1], GETINT_NOEXIT, &err);
+			if (!err && !topk_age_ranges(i, data->age_count, sb))
+				q->reply = q->merged = strbuf_steal(sb);
+			else
+				strbuf_free(sb);
+		}
+		else if (data->country_count->size) {
+			Strbuf* sb = strbuf_init();
+
+			for (i = 0; i < data->country_count->size; ++i) {
+				cc = data->country_count->entry[i];
+				strbuf_appendf(sb, "%s %d\n", cc->country, cc->n);
+			}
+			q->reply = q->merged = strbuf_steal(sb);
+		}
+
+		vector_free(data->country_count, country_count_free);
+	}
+
+	if (data->rows && data->rows->len) {
+		write_msg(conn->fd, data->rows->buf);
+		fprintf(q->log, "%s", data->rows->buf);
+	}
+
+	write_msg_id_end(conn->fd, 0, q->reply ? q->reply : "");
+	if (q->reply)
+		fprintf(q->log, "%s", q->reply);
+
+	// Whatever has been logged past the query is what the client got
+	if (q->key && !q->cached) {
+		fflush(q->log);
+		cache_put(g_cache, q->key, q->tag, q->logbuf +q->logpos, q->epoch);
+	}
+
+	fprintf(q->log, "\n");
+	fclose(q->log);
+	log_flush(q->logbuf, q->loglen);
+
+end:
+	strbuf_free(data->rows);
+	vector_free(q->cmdarg, free);
+	free(q->merged);
+	free(q->cached);
+	free(q->key);
+	free(q->query);
+	free(q);
+}
+
+/* Handle the messages of a worker that have arrived so far: the one the reactor has
+ * read and those that came along with it. The empty message ends the stream.
+ * Return value:
+ * 1 once the stream has ended, 0 if more is to come, -1 on a malformed frame
+ * */
+int conn_stats_handler(Conn* conn, Vector* workers, Hashtable* routes)
+{
+	Vector* shards;
+	Bloom* ids;
+	char* msg;
+	char port_str[7];
+	int  port;
+	int  err;
+	int  ret;
+
+	conn->started = true;
+
+	do {
+		msg = conn->query;
+
+		// A worker sends all of its statistics over the connection it registers with
+		if (!conn->len) {
+			if (conn->registered) {
+				pthread_rwlock_wrlock(&rwlock_workers);
+				routes_set_ready(routes, conn->worker);
+				pthread_rwlock_unlock(&rwlock_workers);
+			}
+			return 1;
+		}
+
+		if (!strncmp(msg, "PORT:", 5) && !conn->worker) {
+			strncpy(port_str, &msg[5], sizeof(port_str) -1);
+			port_str[sizeof(port_str) -1] = '\0';
+			port = getint(port_str, 0);
+
+			conn->worker_addr = conn->addr;
+			conn->worker_addr.sin_port = htons(port);
+			conn->worker = worker_init(&conn->worker_addr);
+			conn->named  = true;
+		}
+		// A registered worker sending updates
+		else if (!strncmp(msg, "WORKER:", 7)) {
+			port = getint(&msg[7], GETINT_NOEXIT, &err);
+
+			conn->worker_addr = conn->addr;
+			conn->worker_addr.sin_port = htons(port);
+			conn->named = !err;
+		}
+		else if (!strncmp(msg, "COUNTRIES:", 10) && conn->worker) {
+			shards = tokenize(&msg[10], "\n");
+
+			pthread_rwlock_wrlock(&rwlock_workers);
+			workers_register(workers, routes, conn->worker, shards);
+			pthread_rwlock_unlock(&rwlock_workers);
+
+			vector_free(shards, free);
+			conn->registered = true;
+		}
+		else if (!strncmp(msg, "UPDATED:", 8)) {
+			if (g_cache)
+				cache_invalidate(g_cache, &msg[8]);
+		}
+		else if (bloom_is_filter(msg, conn->len)) {
+			if (conn->named && (ids = bloom_parse(msg, conn->len))) {
+				pthread_rwlock_wrlock(&rwlock_workers);
+				workers_set_ids(workers, &conn->worker_addr, ids);
+				pthread_rwlock_unlock(&rwlock_workers);
+			}
+		}
+		else
+			stats_store(msg, conn->len);
+	} while ((ret = conn_next_query(conn)) == 1);
+
+	return ret;
+}
+
+/* Answer /diseaseFrequency, /topk-AgeRanges and /numPatientAdmissions from the
+ * cube. That takes well-formed dates and the statistics of every shard the query
+ * concerns; anything else is left to the workers.
+ * Return value:
+ * true if the query has been answered, with reply set to NULL for an empty reply
+ * */
+bool cube_reply(Command* command, Vector* cmdarg, Hashtable* routes, char** reply)
+{
+	int count[STATS_AGE_RANGES];
+	char* const virus = vector_get(cmdarg, (command->val == TOPK_AGE_RANGES) ? 3 : 1);
+	char* country = NULL;
+	char* name;
+	Strbuf* lines;
+	int from, until;
+	int sum = 0;
+	int k;
+	int err;
+	int i, j;
+
+	if (command->val != DISEASE_FREQUENCY && command->val != TOPK_AGE_RANGES &&
+	    command->val != NUM_PATIENT_ADMISSIONS)
+		return false;
+
+	from  = cube_date(vector_get(cmdarg, command->datearg_pos));
+	until = cube_date(vector_get(cmdarg, command->datearg_pos +1));
+	if (from == -1 || until == -1)
+		return false;
+
+	if (cmdarg->size > command->cntrarg_pos)
+		country = cmdarg->entry[command->cntrarg_pos];
+
+	pthread_rwlock_rdlock(&rwlock_workers);
+	if (!routes_ready(routes, country)) {
+		pthread_rwlock_unlock(&rwlock_workers);
+		return false;
+	}
+	pthread_rwlock_unlock(&rwlock_workers);
+
+	*reply = NULL;
+
+	cube_rdlock(g_cube);
+
+	switch (command->val) {
+	case DISEASE_FREQUENCY:
+		for (i = 0; i < g_cube->names->size; ++i) {
+			name = country ? country : g_cube->names->entry[i];
+
+			cube_sum(g_cube, name, virus, from, until, count);
+			for (j = 0; j < STATS_AGE_RANGES; ++j)
+				sum += count[j];
+
+			if (country)
+				break;
+		}
+		xsprintf(reply, "%d\n", sum);
+		break;
+
+	case TOPK_AGE_RANGES:
+		k = getint(cmdarg->entry[1], GETINT_NOEXIT, &err);
+		if (!err && !cube_sum(g_cube, country, virus, from, until, count)) {
+			lines = strbuf_init();
+			if (!topk_age_ranges(k, count, lines))
+				*reply = strbuf_steal(lines);
+			else
+				strbuf_free(lines);
+		}
+		break;
+
+	default:
+		lines = strbuf_init();
+		for (i = 0; i < g_cube->names->size; ++i) {
+			name = country ? country : g_cube->names->entry[i];
+
+			// Countries without any patients are left out, as by the workers
+			if (!cube_sum(g_cube, name, virus, from, until, count)) {
+				for (sum = 0, j = 0; j < STATS_AGE_RANGES; ++j)
+					sum += count[j];
+
+				strbuf_appendf(lines, "%s %d\n", name, sum);
+			}
+
+			if (country)
+				break;
+		}
+
+		if (lines->len)
+			*reply = strbuf_steal(lines);
+		else
+			strbuf_free(lines);
+	}
+
+	cube_unlock(g_cube);
+
+	return true;
+}
+
+/* Normalize a query into its cache key: the arguments separated by single spaces */
+char* query_key(Vector* cmdarg)
+{
+	Strbuf* key = strbuf_init();
+	int i;
+
+	for (i = 0; i < cmdarg->size; ++i) {
+		if (i)
+			strbuf_append(key, " ");
+		strbuf_append(key, cmdarg->entry[i]);
+	}
+
+	return strbuf_steal(key);
+}
+
+/* Store a batch of statistics in the cube, then drop the cached results of the
+ * countries it concerns */
+void stats_store(const char* msg, size_t len)
+{
+	Vector* countries = vector_init();
+	int i;
+
+	cube_wrlock(g_cube);
+	if (stats_parse(msg, len, countries, stats_record_cb))
+		fprintf(stderr, "Malformed statistics batch\n");
+	cube_unlock(g_cube);
+
+	if (g_cache)
+		for (i = 0; i < countries->size; ++i)
+			cache_invalidate(g_cache, countries->entry[i]);
+
+	vector_free(countries, NULL);
+}
+
+void stats_record_cb(const char* country, const char* virus, int date,
+                     const int count[STATS_AGE_RANGES], void* cb_data)
+{
+	Vector* countries = cb_data;
+	int i;
+
+	cube_set(g_cube, country, virus, date, count);
+
+	// The names of a batch are shared by its records, so a country is always the
+	// same pointer
+	for (i = 0; i < countries->size; ++i)
+		if (countries->entry[i] == country)
+			return;
+
+	vector_append(countries, (char*)country);
+}
+
+/* Queries log into a private in-memory stream that is emitted here in one piece, so
+ * that the print lock is only held for the duration of a single fwrite() */
+void log_flush(char* logbuf, size_t loglen)
+{
+	pthread_mutex_lock(&mutex_print);
+	fwrite(logbuf, 1, loglen, stdout);
+	fflush(stdout);
+	pthread_mutex_unlock(&mutex_print);
+
+	free(logbuf);
+}
+
+/* Add a worker and route its shards to it. A shard is a whole country, "country", or
+ * a range of its dates, "country\tfrom\tuntil" with * for an open bound. A worker
+ * that previously held any of these shards has been replaced (e.g. respawned by
+ * master) and is dropped. */
+void workers_register(Vector* workers, Hashtable* routes, Worker* w,
+                      Vector* shards)
+{
+	Vector* country_routes;
+	Vector* tok;
+	Route*  route;
+	Worker* prev;
+	Vector* replaced = vector_init();  // Workers whose shards w took over
+	int from, until;
+	int pos;
+	int i, j;
+
+	for (i = 0; i < shards->size; ++i) {
+		tok   = tokenize(shards->entry[i], "\t");
+		// Bounds other than dates, such as *, are open
+		from  = (tok->size == 3) ? cube_date(tok->entry[1]) : -1;
+		until = (tok->size == 3) ? cube_date(tok->entry[2]) : -1;
+		if (from == -1)
+			from = 0;
+		if (until == -1)
+			until = INT_MAX;
+
+		// Results computed before a worker (re)joined may be incomplete
+		if (g_cache)
+			cache_invalidate(g_cache, tok->entry[0]);
+
+		country_routes = hashtable_find(routes, tok->entry[0]);
+		if (!country_routes) {
+			country_routes = vector_init();
+			hashtable_insert(routes, tok->entry[0], country_routes);
+		}
+		vector_free(tok, free);
+
+		for (j = 0; j < country_routes->size; ++j) {
+			route = country_routes->entry[j];
+			if (route->from == from && route->until == until)
+				break;
+		}
+
+		if (j == country_routes->size) {
+			route = xmalloc(sizeof(*route));
+			route->from   = from;
+			route->until  = until;
+			route->worker = w;
+			route->ready  = false;
+			vector_append(country_routes, route);
+			g_nroutes++;
+			continue;
+		}
+
+		prev = route->worker;
+		route->worker = w;
+
+		if (prev != w && vector_find(replaced, prev, worker_comp) == -1)
+			vector_append(replaced, prev);
+	}
+
+	// A replaced worker may have held shards the new one did not take over
+	for (i = 0; i < replaced->size; ++i) {
+		prev = replaced->entry[i];
+		routes_drop(routes, prev);
+
+		if ((pos = vector_find(workers, prev, worker_comp)) != -1) {
+			workers->entry[pos] = workers->entry[workers->size -1];
+			workers->size--;
+			worker_put(prev);
+		}
+	}
+	vector_free(replaced, NULL);
+
+	vector_append(workers, worker_get(w));
+}
+
+/* Remove the routes to a worker about to be freed, so that none is left dangling.
+ * The caller holds rwlock_workers for writing */
+void routes_drop(Hashtable* routes, Worker* w)
+{
+	Vector* country_routes;
+	Route* route;
+	Keyval* kv;
+	int i;
+
+	while ((kv = hashtable_next(routes))) {
+		country_routes = kv->val;
+		for (i = 0; i < country_routes->size; ) {
+			route = country_routes->entry[i];
+			if (route->worker != w) {
+				i++;
+				continue;
+			}
+
+			if (route->ready)
+				g_nready--;
+			g_nroutes--;
+
+			country_routes->entry[i] = country_routes->entry[country_routes->size -1];
+			country_routes->size--;
+			free(route);
+		}
+	}
+}
+
+/* Find the workers a country-scoped query concerns: the holders of the country's
+ * shards whose admissions may be counted. Discharges in a range may be of patients
+ * admitted at any earlier date. A worker never holds two shards of a country.
+ * Return value:
+ * The number of workers placed in workers
+ * */
+int workers_route(Hashtable* routes, Command* command, Vector* cmdarg,
+                  Worker** workers, int max)
+{
+	Vector* country_routes;
+	Route* route;
+	int start, end;
+	int n = 0;
+	int i;
+
+	country_routes = hashtable_find(routes, cmdarg->entry[command->cntrarg_pos]);
+	if (!country_routes)
+		return 0;
+
+	// A range with no valid date at either end is open there
+	if ((start = cube_date(vector_get(cmdarg, command->datearg_pos))) == -1)
+		start = 0;
+	if ((end = cube_date(vector_get(cmdarg, command->datearg_pos +1))) == -1)
+		end = INT_MAX;
+
+	for (i = 0; i < country_routes->size && n < max; ++i) {
+		route = country_routes->entry[i];
+
+		if (route->from > end)
+			continue;
+		if (command->val != NUM_PATIENT_DISCHARGES && route->until <= start)
+			continue;
+
+		workers[n++] = route->worker;
+	}
+
+	return n;
+}
+
+/* Find the workers that may hold a patient id: the ones whose published ids pass the
+ * filter, and the ones yet to publish theirs. The caller holds rwlock_workers.
+ * Return value:
+ * The number of workers placed in holders
+ * */
+int workers_find_id(Vector* workers, const char* id, Worker** holders)
+{
+	Worker* w;
+	int n = 0;
+	int i;
+
+	for (i = 0; i < workers->size; ++i) {
+		w = workers->entry[i];
+		if (!w->ids || bloom_test(w->ids, id))
+			holders[n++] = w;
+	}
+
+	return n;
+}
+
+/* Replace the published ids of the worker at addr. They are dropped if the worker
+ * has been replaced since. The caller holds rwlock_workers for writing */
+void workers_set_ids(Vector* workers, const struct sockaddr_in* addr, Bloom* ids)
+{
+	Worker* w;
+	int i;
+
+	for (i = 0; i < workers->size; ++i) {
+		w = workers->entry[i];
+		if (w->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+		    w->addr.sin_port == addr->sin_port)
+		{
+			bloom_free(w->ids);
+			w->ids = ids;
+			return;
+		}
+	}
+
+	bloom_free(ids);
+}
+
+/* Check whether every shard of a country, or of every country if NULL, has had its
+ * statistics stored in the cube. The caller holds rwlock_workers, possibly for
+ * reading only, so the routes are not traversed */
+bool routes_ready(Hashtable* routes, const char* country)
+{
+	Vector* country_routes;
+	int i;
+
+	if (country) {
+		if ((country_routes = hashtable_find(routes, country)) == NULL)
+			return false;
+
+		for (i = 0; i < country_routes->size; ++i)
+			if (!((Route*)country_routes->entry[i])->ready)
+				return false;
+
+		return true;
+	}
+
+	return g_nroutes && g_nready == g_nroutes;
+}
+
+/* Mark the shards of a worker as ready. A respawned worker takes over shards that
+ * already are. The caller holds rwlock_workers for writing */
+void routes_set_ready(Hashtable* routes, Worker* w)
+{
+	Vector* country_routes;
+	Route* route;
+	Keyval* kv;
+	int i;
+
+	while ((kv = hashtable_next(routes))) {
+		country_routes = kv->val;
+		for (i = 0; i < country_routes->size; ++i) {
+			route = country_routes->entry[i];
+			if (route->worker == w && !route->ready) {
+				route->ready = true;
+				g_nready++;
+			}
+		}
+	}
+}
+
+void routes_free_generic(void* routes)
+{
+	vector_free(routes, free);
+}
+
+Worker* worker_init(const struct sockaddr_in* addr)
+{
+	Worker* w = xmalloc(sizeof(*w));
+
+	w->addr = *addr;
+	w->ids  = NULL;
+	w->idle = vector_init();
+	if (!w->idle)
+		abort();
+
+	pthread_mutex_init(&w->mutex, NULL);
+	atomic_init(&w->refs, 1);
+
+	return w;
+}
+
+Worker* worker_get(Worker* w)
+{
+	atomic_fetch_add(&w->refs, 1);
+
+	return w;
+}
+
+/* Drop a reference to the worker. The last one frees it along with its pool */
+void worker_put(Worker* w)
+{
+	if (atomic_fetch_sub(&w->refs, 1) != 1)
+		return;
+
+	vector_free(w->idle, worker_conn_free_generic);
+	bloom_free(w->ids);
+	pthread_mutex_destroy(&w->mutex);
+	free(w);
+}
+
+void worker_put_generic(void* w)
+{
+	worker_put(w);
+}
+
+int worker_comp(const void* w1, const void* w2)
+{
+	return w1 != w2;
+}
+
+/* Take an idle connection from the worker's pool or open a new one if the pool is
+ * empty. pooled is set to whether the connection has served earlier requests.
+ * Return value:
+ * The connection, or NULL if the worker refused it
+ * */
+Worker_conn* worker_conn_get(Worker* w, bool* pooled)
+{
+	Worker_conn* wc;
+	int fd;
+
+	pthread_mutex_lock(&w->mutex);
+	wc = vector_pop(w->idle);
+	pthread_mutex_unlock(&w->mutex);
+
+	if ((*pooled = (wc != NULL)))
+		return wc;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		syserr_exit("socket()");
+
+	if (connect(fd, (struct sockaddr*)&w->addr, (socklen_t)sizeof(w->addr))) {
+		if (errno == ECONNREFUSED) {
+			close(fd);
+			return NULL;
+		}
+		else
+			syserr_exit("connect()");
+	}
+
+	// Written to while replies are read, so a worker busy writing its replies
+	// cannot block the sub-queries it has yet to read, or the other way around
+	set_blocking(fd, false);
+
+	wc = xmalloc(sizeof(*wc));
+	wc->fd = fd;
+	wc->reader = msg_reader_init(fd);
+
+	return wc;
+}
+
+void worker_conn_put(Worker* w, Worker_conn* wc)
+{
+	pthread_mutex_lock(&w->mutex);
+	vector_append(w->idle, wc);
+	pthread_mutex_unlock(&w->mutex);
+}
+
+void worker_conn_free(Worker_conn* wc)
+{
+	msg_reader_free(wc->reader);
+	close(wc->fd);
+	free(wc);
+}
+
+void worker_conn_free_generic(void* wc)
+{
+	worker_conn_free(wc);
+}
+
+/* Send the link's next sub-queries, keeping at most BATCH_WINDOW of them in flight
+ * so that neither side ever blocks writing to the other. The first send takes one of
+ * the worker's connections, falling back to the next one (eventually a fresh one) if
+ * a pooled connection turns out to be stale.
+ * Return value:
+ * 0 on success, -1 if the worker cannot be reached
+ * */
+int worker_link_send(Worker_link* link)
+{
+	int n;
+	int i;
+
+	do {
+		if (!link->wc) {
+			if ((link->wc = worker_conn_get(link->worker, &link->pooled)) == NULL)
+				return -1;
+
+			link->base  = atomic_fetch_add(&g_reqid, link->ncalls);
+			link->nsent = 0;
+			strbuf_clear(link->out);
+		}
+
+		n = link->ndone +BATCH_WINDOW -link->nsent;
+		if (n > link->ncalls -link->nsent)
+			n = link->ncalls -link->nsent;
+
+		for (i = 0; i < n; ++i)
+			msg_append_id(link->out, link->base +link->nsent +i +1,
+			              link->calls[link->nsent +i]->query);
+		link->nsent += n;
+
+		if (msg_flush(link->wc->fd, link->out) == 0)
+			return 0;
+
+		worker_conn_free(link->wc);
+		link->wc = NULL;
+	} while (link->pooled && !link->nrecv);
+
+	return -1;
+}
+
+/* Consume whatever the worker has sent so far, passing each chunk of a reply to cb as
+ * it arrives. Meant to be called when the connection is readable, so that it never
+ * blocks. A sub-query is answered once the empty frame ending its reply is in. Once
+ * they all are, the connection returns to the worker's pool. If a pooled connection
+ * was stale, the sub-queries are sent again.
+ * Return value:
+ * 1 if every reply is complete, 0 if more data is needed, -1 if the worker failed
+ * */
+int worker_link_recv(Worker_link* link, Reply_cb cb)
+{
+	Msg_reader* reader = link->wc->reader;
+	Worker_call* call;
+	char* chunk;
+	ssize_t len;
+	uint32_t i;
+	int ret;
+
+	if (msg_reader_fill(reader) == 0)
+		goto fail;
+
+	while ((ret = msg_reader_next(reader, &chunk, &len)) == 1) {
+		i = reader->id -link->base -1;
+		if (i >= link->nsent || link->calls[i]->done) {
+			free(chunk);
+			goto fail;
+		}
+
+		call = link->calls[i];
+		link->nrecv++;
+
+		if (!chunk) {
+			call->done = true;
+			link->ndone++;
+			continue;
+		}
+
+		cb(chunk, call->cb_data);
+		free(chunk);
+	}
+
+	if (ret == -1)
+		goto fail;
+
+	if (link->ndone == link->ncalls) {
+		worker_conn_put(link->worker, link->wc);
+		link->wc = NULL;
+		return 1;
+	}
+
+	if (link->nsent < link->ncalls && link->nsent -link->ndone < BATCH_WINDOW/2)
+		return worker_link_send(link);
+
+	return 0;
+
+fail:
+	worker_conn_free(link->wc);
+	link->wc = NULL;
+
+	// Sending the sub-queries again would repeat what has been passed on
+	if (link->pooled && !link->nrecv && worker_link_send(link) == 0)
+		return 0;
+
+	return -1;
+}
+
+/* Send the sub-queries to their workers at once and pass each chunk of the replies to
+ * cb as soon as it arrives, so that the total latency is that of the slowest worker
+ * rather than the sum of all of them. The sub-queries to a worker share a single
+ * connection, over which they are pipelined. Unreachable workers are skipped. */
+void workers_fanout(Worker_call* calls, int ncalls, Reply_cb cb)
+{
+	Worker_link*   link  = xcalloc(ncalls ? ncalls : 1, sizeof(*link));
+	Worker_call**  order = xmalloc((ncalls ? ncalls : 1)*sizeof(*order));
+	struct pollfd* pfd;
+	int nlinks = 0;
+	int pending = 0;
+	int i, j, k;
+
+	// Group the sub-queries by worker, keeping their order
+	for (i = 0; i < ncalls; ++i) {
+		for (j = 0; j < nlinks; ++j)
+			if (link[j].worker == calls[i].worker)
+				break;
+
+		if (j == nlinks)
+			link[nlinks++].worker = calls[i].worker;
+		link[j].ncalls++;
+	}
+
+	for (j = 0, k = 0; j < nlinks; ++j) {
+		link[j].calls = &order[k];
+		k += link[j].ncalls;
+		link[j].ncalls = 0;
+	}
+
+	for (i = 0; i < ncalls; ++i) {
+		for (j = 0; link[j].worker != calls[i].worker; ++j)
+			;
+		link[j].calls[link[j].ncalls++] = &calls[i];
+	}
+
+	for (j = 0; j < nlinks; ++j)
+		link[j].out = strbuf_init();
+
+	// Worker exited?
+	for (j = 0; j < nlinks; ++j)
+		if (worker_link_send(&link[j]) == 0)
+			pending++;
+
+	pfd = xmalloc((nlinks ? nlinks : 1)*sizeof(*pfd));
+
+	while (pending) {
+		for (j = 0; j < nlinks; ++j)
+			pfd[j] = (struct pollfd){ .fd = link[j].wc ? link[j].wc->fd : -1,
+			                          .events = POLLIN |
+			                                    (link[j].out->len ? POLLOUT : 0) };
+
+		if (poll(pfd, nlinks, -1) == -1) {
+			if (errno == EINTR) continue;
+			syserr_exit("poll()");
+		}
+
+		for (j = 0; j < nlinks; ++j) {
+			if (!pfd[j].revents)
+				continue;
+
+			// A failed write shows up as the connection being lost when read
+			if (pfd[j].revents & POLLOUT)
+				msg_flush(link[j].wc->fd, link[j].out);
+
+			if ((pfd[j].revents & ~POLLOUT) && worker_link_recv(&link[j], cb) != 0)
+				pending--;
+		}
+	}
+
+	for (j = 0; j < nlinks; ++j)
+		strbuf_free(link[j].out);
+	free(pfd);
+	free(order);
+	free(link);
+}
+
+/* Merge a chunk of a worker's reply into the client's reply. Called while the
+ * workers are being asked, so nothing is written to the client here */
+void reply_cb(char* reply, void* cb_data)
+{
+	struct reply_cb_data* data = cb_data;
+	int count[STATS_AGE_RANGES];
+	int dss_freq;
+	int i;
+
+	if (data->cmd == DISEASE_FREQUENCY) {
+		dss_freq = getint(reply, 0);
+		if (dss_freq != -1)
+			data->dss_freq_sum += dss_freq;
+	}
+	else if (data->cmd == TOPK_AGE_RANGES) {
+		if (reply && sscanf(reply, "%d %d %d %d", &count[0], &count[1], &count[2],
+		                    &count[3]) == STATS_AGE_RANGES)
+		{
+			for (i = 0; i < STATS_AGE_RANGES; ++i)
+				data->age_count[i] += count[i];
+			data->age_replied = true;
+		}
+	}
+	else if (data->cmd == NUM_PATIENT_ADMISSIONS ||
+	         data->cmd == NUM_PATIENT_DISCHARGES)
+	{
+		if (reply)
+			reply_counts_add(data, reply);
+	}
+	else
+		strbuf_append(data->rows, reply);
+}
+
+/* Add the "country count" lines of a reply to the counts of their countries */
+void reply_counts_add(struct reply_cb_data* data, char* reply)
+{
+	Country_count* cc;
+	Vector* lines;
+	char* line;
+	char* sep;
+	int i, j;
+
+	lines = tokenize(reply, "\n");
+
+	for (i = 0; i < lines->size; ++i) {
+		line = lines->entry[i];
+		if ((sep = strrchr(line, ' ')) == NULL)
+			continue;
+		*sep = '\0';
+
+		for (j = 0; j < data->country_count->size; ++j) {
+			cc = data->country_count->entry[j];
+			if (!strcmp(cc->country, line))
+				break;
+		}
+
+		if (j == data->country_count->size) {
+			cc = xmalloc(sizeof(*cc));
+			cc->country = xstrdup(line);
+			cc->n = 0;
+			vector_append(data->country_count, cc);
+		}
+
+		cc->n += atoi(sep +1);
+	}
+
+	vector_free(lines, free);
+}
+
+void country_count_free(void* cc)
+{
+	free(((Country_count*)cc)->country);
+	free(cc);
 }